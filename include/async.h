@@ -9,11 +9,27 @@
 
 #include <gimxpoll/include/gpoll.h>
 
+#ifndef WIN32
+#include <gimxtime/include/gtime.h>
+#include <sys/uio.h>
+#endif
+
 typedef enum {
     E_ASYNC_DEVICE_TYPE_SERIAL,
     E_ASYNC_DEVICE_TYPE_HID,
 } e_async_device_type;
 
+typedef enum {
+    E_ASYNC_WRITE_POLICY_FIFO,         // writes are rejected when the queue is full
+    E_ASYNC_WRITE_POLICY_DROP_OLDEST,  // the oldest pending write is dropped when the queue is full
+    E_ASYNC_WRITE_POLICY_REPLACE,      // the pending write is overwritten (latest value wins)
+} e_async_write_policy;
+
+typedef enum {
+    E_ASYNC_ENGINE_POLL,
+    E_ASYNC_ENGINE_IO_URING,
+} e_async_engine;
+
 typedef int (* ASYNC_READ_CALLBACK)(void * user, const void * buf, int status);
 typedef int (* ASYNC_WRITE_CALLBACK)(void * user, int status);
 typedef int (* ASYNC_CLOSE_CALLBACK)(void * user);
@@ -35,6 +51,70 @@ typedef struct {
 
 struct async_device;
 
+#ifndef WIN32
+typedef enum {
+    E_ASYNC_FRAMING_NONE,
+    E_ASYNC_FRAMING_FIXED,     // frames of 'size' bytes
+    E_ASYNC_FRAMING_LENGTH,    // frames with a length field
+    E_ASYNC_FRAMING_DELIMITER, // frames terminated by 'delimiter'
+} e_async_framing;
+
+typedef enum {
+    E_ASYNC_CHECKSUM_NONE,
+    E_ASYNC_CHECKSUM_CRC32C,   // 4 trailing bytes, little endian
+} e_async_checksum;
+
+typedef struct {
+    e_async_framing type;
+    unsigned int max_size;     // maximum frame size, including the length field and the checksum
+    unsigned int size;         // E_ASYNC_FRAMING_FIXED
+    struct {
+        unsigned int offset;   // offset of the length field
+        unsigned int width;    // size of the length field (1 to 4 bytes)
+        int big_endian;
+        int adjust;            // frame size = length field value + adjust
+    } length;                  // E_ASYNC_FRAMING_LENGTH
+    unsigned char delimiter;   // E_ASYNC_FRAMING_DELIMITER
+    e_async_checksum checksum; // computed over the frame, excluding the checksum and the delimiter
+} ASYNC_FRAMING;
+
+typedef struct {
+    unsigned long long bytes_read;
+    unsigned long long packets_read;     // packets or frames delivered to fp_read
+    unsigned long long bytes_written;
+    unsigned long long packets_written;  // completed writes
+    unsigned long long read_calls;       // read syscalls or completions
+    unsigned long long write_calls;      // write syscalls or completions
+    unsigned long long eagain;           // reads and writes that would have blocked
+    unsigned long long short_writes;
+    unsigned long long dropped_writes;   // writes dropped or replaced by the write policy
+    unsigned long long frame_errors;     // invalid frames in framing mode
+    unsigned long long dropped_reads;    // packets dropped by the reader thread
+    unsigned long long paced_writes;     // writes scheduled with async_write_at, and written without being queued
+    gtime paced_lateness_max;            // in nanoseconds
+    gtime paced_lateness_sum;            // in nanoseconds
+    unsigned int queue_high_water;       // maximum number of queued writes
+    long long since_last_packet;         // in nanoseconds, -1 if no packet was received
+} ASYNC_STATS;
+
+typedef int (* ASYNC_DEVICE_CALLBACK)(void * user, struct async_device * device);
+typedef int (* ASYNC_WRITE_AT_CALLBACK)(void * user, int status, gtime lateness);
+
+typedef enum {
+    E_ASYNC_VIRTUAL_PACKET,    // message boundaries are preserved (socketpair, SOCK_SEQPACKET)
+    E_ASYNC_VIRTUAL_STREAM,    // byte stream (socketpair, SOCK_STREAM)
+    E_ASYNC_VIRTUAL_PTY,       // pty in raw mode
+} e_async_virtual;
+
+typedef struct {
+    unsigned int baudrate;     // 0 to keep the current baud rate
+    int raw;                   // 8N1, no flow control, no line processing
+    unsigned char vmin;        // minimum number of bytes for a blocking read
+    unsigned char vtime;       // read timeout in tenths of a second
+    int low_latency;           // set ASYNC_LOW_LATENCY if supported by the driver, 0 leaves it as is
+} ASYNC_SERIAL_PARAMS;
+#endif
+
 struct async_device * async_open_path(const char * path, int print);
 int async_close(struct async_device * device);
 int async_read_timeout(struct async_device * device, void * buf, unsigned int count, unsigned int timeout);
@@ -43,16 +123,40 @@ int async_set_read_size(struct async_device * device, unsigned int size);
 int async_register(struct async_device * device, void * user, const ASYNC_CALLBACKS * callbacks);
 int async_write(struct async_device * device, const void * buf, unsigned int count);
 int async_set_overlapped(struct async_device * device);
+void async_set_write_policy(struct async_device * device, e_async_write_policy policy);
+const char * async_get_path(struct async_device * device);
+void async_set_device_type(struct async_device * device, e_async_device_type device_type);
 
 #ifdef WIN32
 HANDLE * async_get_handle(struct async_device * device);
-const char * async_get_path(struct async_device * device);
-void async_set_device_type(struct async_device * device, e_async_device_type device_type);
 int async_set_write_size(struct async_device * device, unsigned int size);
 void async_set_private(struct async_device * device, void * priv);
 void * async_get_private(struct async_device * device);
 #else
 int async_get_fd(struct async_device * device);
+struct async_device * async_get_device(int fd);
+struct async_device * async_acquire_device(int fd);
+void async_release_device(struct async_device * device);
+int async_writev(struct async_device * device, const struct iovec * iov, int iovcnt);
+int async_write_timeout_v(struct async_device * device, const struct iovec * iov, int iovcnt, unsigned int timeout);
+int async_set_write_coalescing(struct async_device * device, unsigned int window, unsigned int size);
+int async_set_framing(struct async_device * device, const ASYNC_FRAMING * framing);
+int async_get_stats(struct async_device * device, ASYNC_STATS * stats);
+int async_for_each_device(ASYNC_DEVICE_CALLBACK fp, void * user);
+int async_pool_init(unsigned int capacity, unsigned int read_size, unsigned int slots);
+int async_set_read_batch(struct async_device * device, unsigned int slots);
+int async_set_read_ring(struct async_device * device, unsigned int slots);
+int async_release_read_buffer(struct async_device * device, const void * buf);
+int async_set_engine(struct async_device * device, e_async_engine engine);
+e_async_engine async_get_engine(struct async_device * device);
+int async_set_reader_thread(struct async_device * device, int cpu);
+int async_set_serial_params(struct async_device * device, const ASYNC_SERIAL_PARAMS * params);
+int async_set_busy_poll(struct async_device * device, unsigned int spin);
+int async_write_at(struct async_device * device, const void * buf, unsigned int count, gtime deadline);
+void async_set_write_at_callback(struct async_device * device, ASYNC_WRITE_AT_CALLBACK fp);
+int async_set_record(struct async_device * device, const char * path);
+struct async_device * async_open_replay(const char * path, double speed);
+struct async_device * async_open_virtual(e_async_virtual type, int * peer);
 #endif
 
 #endif /* ASYNC_H_ */
@@ -6,13 +6,148 @@
 #ifndef GPERF_H_
 #define GPERF_H_
 
+#include <string.h>
 #include <gimxtime/include/gtime.h>
 #include <gimxlog/include/glog.h>
 
 #define GPERF_XSTR(s) GPERF_STR(s)
 #define GPERF_STR(s) #s
 
-#define GPERF_INST(NAME, SAMPLETYPE, MAXSAMPLES) \
+/*
+ * Clock source.
+ *
+ * By default, times are read with gtime_gettime().
+ * When GPERF_CLOCK_TSC is defined on x86, times are read with rdtsc if the TSC is invariant,
+ * and stored as raw ticks. They are converted to nanoseconds by GPERF_TO_NS when logged,
+ * using a ratio calibrated against gtime_gettime() between program start and the first conversion.
+ * In this mode the TIME argument of GPERF_TICK and GPERF_SHARDED_TICK has to come from GPERF_NOW().
+ */
+#if defined(GPERF_CLOCK_TSC) && (defined(__i386__) || defined(__x86_64__))
+
+#include <cpuid.h>
+#include <x86intrin.h>
+
+#define GPERF_TSC_CALIBRATION_TIME 10000000ULL // ns
+
+static struct {
+    int invariant;
+    unsigned long long tsc0;
+    gtime time0;
+    double ns_per_tick;
+} gperf_clock;
+
+static void __attribute__((constructor)) gperf_clock_init(void) {
+
+    unsigned int eax, ebx, ecx, edx;
+    // invariant TSC: CPUID.80000007H:EDX[8]
+    if (__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) && (edx & (1 << 8))) {
+        gperf_clock.invariant = 1;
+        gperf_clock.time0 = gtime_gettime();
+        gperf_clock.tsc0 = __rdtsc();
+    }
+}
+
+static inline gtime gperf_clock_now(void) {
+
+    return gperf_clock.invariant ? __rdtsc() : gtime_gettime();
+}
+
+static inline gtime gperf_clock_to_ns(gtime ticks) {
+
+    if (!gperf_clock.invariant) {
+        return ticks;
+    }
+    if (gperf_clock.ns_per_tick == 0) {
+        gtime time;
+        unsigned long long tsc;
+        // wait until the calibration interval is long enough, which only happens early in the program
+        do {
+            time = gtime_gettime();
+            tsc = __rdtsc();
+        } while (time - gperf_clock.time0 < GPERF_TSC_CALIBRATION_TIME);
+        gperf_clock.ns_per_tick = (double) (time - gperf_clock.time0) / (tsc - gperf_clock.tsc0);
+    }
+    return ticks * gperf_clock.ns_per_tick;
+}
+
+#define GPERF_NOW() gperf_clock_now()
+#define GPERF_TO_NS(TICKS) gperf_clock_to_ns(TICKS)
+
+#else
+
+#define GPERF_NOW() gtime_gettime()
+#define GPERF_TO_NS(TICKS) (TICKS)
+
+#endif
+
+/*
+ * Log-linear histogram: values below 2^(GPERF_HIST_BITS + 1) have their own bucket,
+ * and each power of two above is split into 2^GPERF_HIST_BITS buckets.
+ * The relative error of a percentile is below 2^-GPERF_HIST_BITS (3% for the default value).
+ */
+#ifndef GPERF_HIST_BITS
+#define GPERF_HIST_BITS 5
+#endif
+
+#define GPERF_HIST_SUB (1U << GPERF_HIST_BITS)
+#define GPERF_HIST_BUCKETS ((64 - GPERF_HIST_BITS + 1) * GPERF_HIST_SUB)
+
+typedef struct {
+    unsigned long long total;
+    gtime max;
+    unsigned int counts[GPERF_HIST_BUCKETS];
+} GPERF_HIST;
+
+static inline unsigned int gperf_hist_index(gtime value) {
+
+    if (value < 2 * GPERF_HIST_SUB) {
+        return value;
+    }
+    unsigned int shift = 63 - __builtin_clzll(value) - GPERF_HIST_BITS;
+    return shift * GPERF_HIST_SUB + (value >> shift);
+}
+
+static inline void gperf_hist_record(GPERF_HIST * hist, gtime value) {
+
+    ++hist->counts[gperf_hist_index(value)];
+    ++hist->total;
+    if (value > hist->max) {
+        hist->max = value;
+    }
+}
+
+/*
+ * Get the value below which 'percentile' percent of the recorded values fall.
+ * The returned value is the upper bound of the matching bucket, capped to the highest recorded value.
+ */
+static inline gtime gperf_hist_percentile(const GPERF_HIST * hist, double percentile) {
+
+    if (hist->total == 0) {
+        return 0;
+    }
+    unsigned long long target = percentile * hist->total / 100;
+    if (target < percentile * hist->total / 100 || target == 0) {
+        ++target;
+    }
+    unsigned long long count = 0;
+    unsigned int index;
+    for (index = 0; index < GPERF_HIST_BUCKETS - 1; ++index) {
+        count += hist->counts[index];
+        if (count >= target) {
+            break;
+        }
+    }
+    gtime upper;
+    if (index < 2 * GPERF_HIST_SUB) {
+        upper = index;
+    } else {
+        unsigned int shift = index / GPERF_HIST_SUB - 1;
+        upper = ((((gtime) index - shift * GPERF_HIST_SUB) + 1) << shift) - 1;
+    }
+    return upper < hist->max ? upper : hist->max;
+}
+
+#define GPERF_INST_STRUCT(SAMPLETYPE, MAXSAMPLES) \
    struct { \
       gtime sum; \
       unsigned long long count; \
@@ -24,7 +159,21 @@
       unsigned int maxsamples; \
       unsigned int last; \
       int wrapped; \
-   } gperf_##NAME = { .maxsamples = MAXSAMPLES }
+      GPERF_HIST * hist; \
+   }
+
+#define GPERF_INST(NAME, SAMPLETYPE, MAXSAMPLES) \
+   GPERF_INST_STRUCT(SAMPLETYPE, MAXSAMPLES) gperf_##NAME = { .maxsamples = MAXSAMPLES }
+
+/*
+ * Same as GPERF_INST, with a histogram updated by GPERF_END and GPERF_TICK,
+ * that allows GPERF_PERCENTILE and GPERF_LOG to report percentiles.
+ */
+#define GPERF_INST_HIST(NAME, SAMPLETYPE, MAXSAMPLES) \
+   GPERF_INST_STRUCT(SAMPLETYPE, MAXSAMPLES) gperf_##NAME = { .maxsamples = MAXSAMPLES, .hist = &(GPERF_HIST) { .total = 0 } }
+
+#define GPERF_PERCENTILE(NAME, PERCENTILE) \
+   (gperf_##NAME.hist != NULL ? GPERF_TO_NS(gperf_hist_percentile(gperf_##NAME.hist, PERCENTILE)) : 0)
 
 #define GPERF_SAMPLE(NAME) \
    gperf_##NAME.samples[gperf_##NAME.last]
@@ -51,19 +200,22 @@
 
 #define GPERF_START(NAME) \
     do { \
-        gperf_##NAME.start = gtime_gettime(); \
+        gperf_##NAME.start = GPERF_NOW(); \
     } while (0)
 
 #define GPERF_END(NAME) \
     do { \
         if (gperf_##NAME.start != 0) { \
-           gperf_##NAME.end = gtime_gettime(); \
+           gperf_##NAME.end = GPERF_NOW(); \
            gperf_##NAME.diff = gperf_##NAME.end - gperf_##NAME.start; \
            if (gperf_##NAME.diff > gperf_##NAME.worst) { \
                gperf_##NAME.worst = gperf_##NAME.diff; \
            } \
            gperf_##NAME.sum += gperf_##NAME.diff; \
            gperf_##NAME.count += 1; \
+           if (gperf_##NAME.hist != NULL) { \
+               gperf_hist_record(gperf_##NAME.hist, gperf_##NAME.diff); \
+           } \
         } \
     } while (0)
 
@@ -77,6 +229,9 @@
            } \
            gperf_##NAME.sum += gperf_##NAME.diff; \
            gperf_##NAME.count += 1; \
+           if (gperf_##NAME.hist != NULL) { \
+               gperf_hist_record(gperf_##NAME.hist, gperf_##NAME.diff); \
+           } \
         } \
         gperf_##NAME.start = gperf_##NAME.end; \
     } while (0)
@@ -84,8 +239,174 @@
 #define GPERF_LOG(NAME) \
     do { \
         if (gperf_##NAME.count) { \
-            printf(GPERF_XSTR(NAME)": count = "GTIME_FS", average = "GTIME_FS", worst = "GTIME_FS"\n", gperf_##NAME.count, gperf_##NAME.sum / gperf_##NAME.count, gperf_##NAME.worst); \
+            printf(GPERF_XSTR(NAME)": count = "GTIME_FS", average = "GTIME_FS", worst = "GTIME_FS"\n", gperf_##NAME.count, GPERF_TO_NS(gperf_##NAME.sum / gperf_##NAME.count), GPERF_TO_NS(gperf_##NAME.worst)); \
+            if (gperf_##NAME.hist != NULL) { \
+                printf(GPERF_XSTR(NAME)": p50 = "GTIME_FS", p99 = "GTIME_FS", p99.9 = "GTIME_FS"\n", GPERF_PERCENTILE(NAME, 50), GPERF_PERCENTILE(NAME, 99), GPERF_PERCENTILE(NAME, 99.9)); \
+            } \
         } \
     } while (0)
 
+/*
+ * Sharded instances, for code that runs on several threads.
+ *
+ * Each thread gets its own cache-line aligned shard the first time it uses the instance,
+ * so that GPERF_SHARDED_START, GPERF_SHARDED_END and GPERF_SHARDED_TICK need no lock.
+ * Threads beyond the number of shards are not measured, and are counted in 'unassigned'.
+ * GPERF_SHARDED_AGGREGATE merges the shards into a regular instance, for GPERF_LOG and GPERF_PERCENTILE.
+ * Shards only hold times: there is no sample buffer.
+ */
+
+#ifndef GPERF_CACHE_LINE_SIZE
+#define GPERF_CACHE_LINE_SIZE 64
+#endif
+
+typedef struct {
+    gtime sum;
+    unsigned long long count;
+    gtime start;
+    gtime worst;
+    GPERF_HIST * hist;
+} __attribute__((aligned(GPERF_CACHE_LINE_SIZE))) GPERF_SHARD;
+
+typedef struct {
+    GPERF_HIST hist;
+} __attribute__((aligned(GPERF_CACHE_LINE_SIZE))) GPERF_SHARD_HIST;
+
+typedef struct {
+    GPERF_SHARD * shard;
+    int assigned;
+} GPERF_SHARD_TLS;
+
+static inline GPERF_SHARD * gperf_shard_assign(GPERF_SHARD_TLS * tls, GPERF_SHARD * shards, GPERF_SHARD_HIST * hists,
+        unsigned int nbshards, unsigned int * next, unsigned int * unassigned) {
+
+    unsigned int index = __atomic_fetch_add(next, 1, __ATOMIC_RELAXED);
+    if (index < nbshards) {
+        tls->shard = shards + index;
+        if (hists != NULL) {
+            __atomic_store_n(&tls->shard->hist, &hists[index].hist, __ATOMIC_RELEASE);
+        }
+    } else {
+        __atomic_fetch_add(unassigned, 1, __ATOMIC_RELAXED);
+    }
+    tls->assigned = 1;
+    return tls->shard;
+}
+
+/*
+ * Only the owning thread writes a shard. The stores are atomic so that the shards can be aggregated at any time.
+ */
+static inline void gperf_shard_record(GPERF_SHARD * shard, gtime diff) {
+
+    __atomic_store_n(&shard->sum, shard->sum + diff, __ATOMIC_RELAXED);
+    __atomic_store_n(&shard->count, shard->count + 1, __ATOMIC_RELAXED);
+    if (diff > shard->worst) {
+        __atomic_store_n(&shard->worst, diff, __ATOMIC_RELAXED);
+    }
+    GPERF_HIST * hist = shard->hist;
+    if (hist != NULL) {
+        unsigned int index = gperf_hist_index(diff);
+        __atomic_store_n(&hist->counts[index], hist->counts[index] + 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&hist->total, hist->total + 1, __ATOMIC_RELAXED);
+        if (diff > hist->max) {
+            __atomic_store_n(&hist->max, diff, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/*
+ * Merge the shards. The histograms are only merged if hist is not NULL.
+ */
+static inline void gperf_shards_merge(GPERF_SHARD * shards, unsigned int nbshards, gtime * sum, unsigned long long * count,
+        gtime * worst, GPERF_HIST * hist) {
+
+    *sum = 0;
+    *count = 0;
+    *worst = 0;
+    if (hist != NULL) {
+        memset(hist, 0x00, sizeof(*hist));
+    }
+    unsigned int i, j;
+    for (i = 0; i < nbshards; ++i) {
+        *sum += __atomic_load_n(&shards[i].sum, __ATOMIC_RELAXED);
+        *count += __atomic_load_n(&shards[i].count, __ATOMIC_RELAXED);
+        gtime shard_worst = __atomic_load_n(&shards[i].worst, __ATOMIC_RELAXED);
+        if (shard_worst > *worst) {
+            *worst = shard_worst;
+        }
+        GPERF_HIST * shard_hist = __atomic_load_n(&shards[i].hist, __ATOMIC_ACQUIRE);
+        if (hist != NULL && shard_hist != NULL) {
+            for (j = 0; j < GPERF_HIST_BUCKETS; ++j) {
+                hist->counts[j] += __atomic_load_n(&shard_hist->counts[j], __ATOMIC_RELAXED);
+            }
+            hist->total += __atomic_load_n(&shard_hist->total, __ATOMIC_RELAXED);
+            gtime shard_max = __atomic_load_n(&shard_hist->max, __ATOMIC_RELAXED);
+            if (shard_max > hist->max) {
+                hist->max = shard_max;
+            }
+        }
+    }
+}
+
+#define GPERF_INST_SHARDED_STRUCT(SHARDS) \
+   struct { \
+      GPERF_SHARD shards[SHARDS]; \
+      GPERF_SHARD_HIST * hists; \
+      unsigned int nbshards; \
+      unsigned int next; \
+      unsigned int unassigned; \
+   }
+
+#define GPERF_INST_SHARDED(NAME, SHARDS) \
+   static __thread GPERF_SHARD_TLS gperf_tls_##NAME; \
+   GPERF_INST_SHARDED_STRUCT(SHARDS) gperf_##NAME = { .nbshards = SHARDS }
+
+/*
+ * Same as GPERF_INST_SHARDED, with a histogram per shard.
+ */
+#define GPERF_INST_SHARDED_HIST(NAME, SHARDS) \
+   static __thread GPERF_SHARD_TLS gperf_tls_##NAME; \
+   GPERF_INST_SHARDED_STRUCT(SHARDS) gperf_##NAME = { .nbshards = SHARDS, .hists = (GPERF_SHARD_HIST[SHARDS]) { { .hist = { .total = 0 } } } }
+
+#define GPERF_SHARD_GET(NAME) \
+   (gperf_tls_##NAME.assigned ? gperf_tls_##NAME.shard \
+         : gperf_shard_assign(&gperf_tls_##NAME, gperf_##NAME.shards, gperf_##NAME.hists, gperf_##NAME.nbshards, \
+               &gperf_##NAME.next, &gperf_##NAME.unassigned))
+
+#define GPERF_SHARDED_START(NAME) \
+    do { \
+        GPERF_SHARD * gperf_shard = GPERF_SHARD_GET(NAME); \
+        if (gperf_shard != NULL) { \
+            gperf_shard->start = GPERF_NOW(); \
+        } \
+    } while (0)
+
+#define GPERF_SHARDED_END(NAME) \
+    do { \
+        GPERF_SHARD * gperf_shard = GPERF_SHARD_GET(NAME); \
+        if (gperf_shard != NULL && gperf_shard->start != 0) { \
+            gperf_shard_record(gperf_shard, GPERF_NOW() - gperf_shard->start); \
+        } \
+    } while (0)
+
+#define GPERF_SHARDED_TICK(NAME, TIME) \
+    do { \
+        GPERF_SHARD * gperf_shard = GPERF_SHARD_GET(NAME); \
+        if (gperf_shard != NULL) { \
+            gtime gperf_end = TIME; \
+            if (gperf_shard->start != 0) { \
+                gperf_shard_record(gperf_shard, gperf_end - gperf_shard->start); \
+            } \
+            gperf_shard->start = gperf_end; \
+        } \
+    } while (0)
+
+/*
+ * Merge the shards of NAME into the regular instance DEST, overwriting its sum, count, worst and histogram.
+ * This can be called while other threads update the shards.
+ */
+#define GPERF_SHARDED_AGGREGATE(NAME, DEST) \
+    gperf_shards_merge(gperf_##NAME.shards, gperf_##NAME.nbshards, &gperf_##DEST.sum, &gperf_##DEST.count, \
+          &gperf_##DEST.worst, gperf_##NAME.hists != NULL ? gperf_##DEST.hist : NULL)
+
 #endif /* GPERF_H_ */
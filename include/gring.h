@@ -0,0 +1,180 @@
+/*
+ Copyright (c) 2026 Mathieu Laurendeau <mat.lau@laposte.net>
+ License: GPLv3
+ */
+
+#ifndef GRING_H_
+#define GRING_H_
+
+/*
+ * Bounded lock-free ring buffers.
+ *
+ * GRING_SPSC(NAME, TYPE, SIZE) and GRING_MPSC(NAME, TYPE, SIZE) declare a gring_NAME type
+ * holding SIZE elements of TYPE, and the following functions:
+ *
+ * void gring_NAME_init(gring_NAME * ring);
+ * unsigned int gring_NAME_push(gring_NAME * ring, const TYPE * items, unsigned int count);
+ * unsigned int gring_NAME_pop(gring_NAME * ring, TYPE * items, unsigned int count);
+ * unsigned int gring_NAME_count(gring_NAME * ring);
+ *
+ * push and pop return the number of elements actually pushed or popped, which may be lower than count.
+ * The SPSC ring also provides in-place access:
+ *
+ * TYPE * gring_NAME_reserve(gring_NAME * ring);   // next free slot, or NULL if the ring is full
+ * void gring_NAME_publish(gring_NAME * ring, unsigned int count);
+ * TYPE * gring_NAME_front(gring_NAME * ring);     // next element, or NULL if the ring is empty
+ * void gring_NAME_consume(gring_NAME * ring, unsigned int count);
+ *
+ * SIZE must be a power of two. Indexes are free-running, and the producer and consumer indexes
+ * are kept in separate cache lines.
+ */
+
+#ifndef GRING_CACHE_LINE_SIZE
+#define GRING_CACHE_LINE_SIZE 64
+#endif
+
+#define GRING_ALIGNED __attribute__((aligned(GRING_CACHE_LINE_SIZE)))
+
+#define GRING_CHECK_SIZE(NAME, SIZE) \
+    typedef char gring_##NAME##_size_check[((SIZE) > 0 && ((SIZE) & ((SIZE) - 1)) == 0) ? 1 : -1]
+
+/*
+ * Single producer, single consumer.
+ * Each side keeps a copy of the other side's index, which is only reloaded when the ring looks full or empty.
+ */
+#define GRING_SPSC(NAME, TYPE, SIZE) \
+    GRING_CHECK_SIZE(NAME, SIZE); \
+    typedef struct { \
+        unsigned int head GRING_ALIGNED; /* written by the producer */ \
+        unsigned int tail_cache; \
+        unsigned int tail GRING_ALIGNED; /* written by the consumer */ \
+        unsigned int head_cache; \
+        TYPE data[SIZE] GRING_ALIGNED; \
+    } gring_##NAME; \
+    static inline void gring_##NAME##_init(gring_##NAME * ring) { \
+        ring->head = ring->tail_cache = 0; \
+        ring->tail = ring->head_cache = 0; \
+    } \
+    static inline unsigned int gring_##NAME##_count(gring_##NAME * ring) { \
+        return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE); \
+    } \
+    static inline unsigned int gring_##NAME##_space(gring_##NAME * ring, unsigned int head, unsigned int count) { \
+        if ((SIZE) - (head - ring->tail_cache) < count) { \
+            ring->tail_cache = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE); \
+        } \
+        return (SIZE) - (head - ring->tail_cache); \
+    } \
+    static inline unsigned int gring_##NAME##_available(gring_##NAME * ring, unsigned int tail, unsigned int count) { \
+        if (ring->head_cache - tail < count) { \
+            ring->head_cache = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE); \
+        } \
+        return ring->head_cache - tail; \
+    } \
+    static inline TYPE * gring_##NAME##_reserve(gring_##NAME * ring) { \
+        unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED); \
+        if (gring_##NAME##_space(ring, head, 1) == 0) { \
+            return NULL; \
+        } \
+        return ring->data + (head & ((SIZE) - 1)); \
+    } \
+    static inline void gring_##NAME##_publish(gring_##NAME * ring, unsigned int count) { \
+        unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED); \
+        __atomic_store_n(&ring->head, head + count, __ATOMIC_RELEASE); \
+    } \
+    static inline TYPE * gring_##NAME##_front(gring_##NAME * ring) { \
+        unsigned int tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED); \
+        if (gring_##NAME##_available(ring, tail, 1) == 0) { \
+            return NULL; \
+        } \
+        return ring->data + (tail & ((SIZE) - 1)); \
+    } \
+    static inline void gring_##NAME##_consume(gring_##NAME * ring, unsigned int count) { \
+        unsigned int tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED); \
+        __atomic_store_n(&ring->tail, tail + count, __ATOMIC_RELEASE); \
+    } \
+    static inline unsigned int gring_##NAME##_push(gring_##NAME * ring, const TYPE * items, unsigned int count) { \
+        unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED); \
+        unsigned int space = gring_##NAME##_space(ring, head, count); \
+        if (count > space) { \
+            count = space; \
+        } \
+        unsigned int i; \
+        for (i = 0; i < count; ++i) { \
+            ring->data[(head + i) & ((SIZE) - 1)] = items[i]; \
+        } \
+        __atomic_store_n(&ring->head, head + count, __ATOMIC_RELEASE); \
+        return count; \
+    } \
+    static inline unsigned int gring_##NAME##_pop(gring_##NAME * ring, TYPE * items, unsigned int count) { \
+        unsigned int tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED); \
+        unsigned int available = gring_##NAME##_available(ring, tail, count); \
+        if (count > available) { \
+            count = available; \
+        } \
+        unsigned int i; \
+        for (i = 0; i < count; ++i) { \
+            items[i] = ring->data[(tail + i) & ((SIZE) - 1)]; \
+        } \
+        __atomic_store_n(&ring->tail, tail + count, __ATOMIC_RELEASE); \
+        return count; \
+    }
+
+/*
+ * Multiple producers, single consumer.
+ * Producers claim a range of slots with a compare-and-swap on the head index, and mark each slot
+ * with its position once written. The consumer stops at the first slot that is not written yet.
+ */
+#define GRING_MPSC(NAME, TYPE, SIZE) \
+    GRING_CHECK_SIZE(NAME, SIZE); \
+    typedef struct { \
+        unsigned int head GRING_ALIGNED; /* claimed by the producers */ \
+        unsigned int tail GRING_ALIGNED; /* written by the consumer */ \
+        struct { \
+            unsigned int seq; /* position + 1 once written */ \
+            TYPE value; \
+        } data[SIZE] GRING_ALIGNED; \
+    } gring_##NAME; \
+    static inline void gring_##NAME##_init(gring_##NAME * ring) { \
+        ring->head = 0; \
+        ring->tail = 0; \
+        unsigned int i; \
+        for (i = 0; i < (SIZE); ++i) { \
+            ring->data[i].seq = 0; \
+        } \
+    } \
+    static inline unsigned int gring_##NAME##_count(gring_##NAME * ring) { \
+        return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE); \
+    } \
+    static inline unsigned int gring_##NAME##_push(gring_##NAME * ring, const TYPE * items, unsigned int count) { \
+        unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED); \
+        unsigned int nb; \
+        do { \
+            unsigned int space = (SIZE) - (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)); \
+            if (space == 0) { \
+                return 0; \
+            } \
+            nb = count < space ? count : space; \
+        } while (!__atomic_compare_exchange_n(&ring->head, &head, head + nb, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)); \
+        unsigned int i; \
+        for (i = 0; i < nb; ++i) { \
+            unsigned int index = (head + i) & ((SIZE) - 1); \
+            ring->data[index].value = items[i]; \
+            __atomic_store_n(&ring->data[index].seq, head + i + 1, __ATOMIC_RELEASE); \
+        } \
+        return nb; \
+    } \
+    static inline unsigned int gring_##NAME##_pop(gring_##NAME * ring, TYPE * items, unsigned int count) { \
+        unsigned int tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED); \
+        unsigned int nb = 0; \
+        while (nb < count) { \
+            unsigned int index = (tail + nb) & ((SIZE) - 1); \
+            if (__atomic_load_n(&ring->data[index].seq, __ATOMIC_ACQUIRE) != tail + nb + 1) { \
+                break; \
+            } \
+            items[nb++] = ring->data[index].value; \
+        } \
+        __atomic_store_n(&ring->tail, tail + nb, __ATOMIC_RELEASE); \
+        return nb; \
+    }
+
+#endif /* GRING_H_ */
@@ -3,10 +3,16 @@
  License: GPLv3
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // ppoll
+#endif
+
 #include "../../include/async.h"
 #include "../../include/gerror.h"
 #include "../../include/glist.h"
+#include "../../include/gring.h"
 #include "gimxlog/include/glog.h"
+#include "gimxtime/include/gtime.h"
 
 #include <stdio.h>
 #include <errno.h>
@@ -17,269 +23,4150 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+
+#include <asm/termbits.h> // termios2, which conflicts with termios.h
+#include <linux/serial.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define ASYNC_HAS_IO_URING
+#endif
+#endif
+
+#ifdef ASYNC_HAS_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+#define ASYNC_MAX_WRITE_QUEUE_SIZE 8
+
+#define ASYNC_INDEX_MIN_SIZE 64
+
+#define ASYNC_POLL_READ  0x01
+#define ASYNC_POLL_WRITE 0x02
+
+// read modes, selected by read_mode_update
+#define ASYNC_READ_MODE_SINGLE    0x00 // a single read per wakeup
+#define ASYNC_READ_MODE_REPLAY    0x01
+#define ASYNC_READ_MODE_FRAMED    0x02
+#define ASYNC_READ_MODE_RING      0x03
+#define ASYNC_READ_MODE_BATCH     0x04
+#define ASYNC_READ_MODE_BUSY_POLL 0x05
 
 GLOG_GET(GLOG_NAME)
 
+typedef struct
+{
+  struct
+  {
+    char * buf;
+    unsigned int size;
+    unsigned int count;
+    unsigned int offset;
+  } data[ASYNC_MAX_WRITE_QUEUE_SIZE];
+  unsigned int nb;
+} s_queue;
+
+#define ASYNC_CACHE_LINE_SIZE 64
+
+#define ASYNC_READER_RING_SIZE 64 // must be a power of two
+
+#define ASYNC_PACING_LEAD 50000 // in nanoseconds, covers the default timer slack
+
+#define ASYNC_RECORD_MAGIC "GIMXASYN"
+#define ASYNC_RECORD_VERSION 1
+#define ASYNC_RECORD_READ  0
+#define ASYNC_RECORD_WRITE 1
+#define ASYNC_RECORD_BUFFER_SIZE 65536
+
+#define ASYNC_REPLAY_BURST 64 // maximum number of packets delivered per replay event
+
+/*
+ * Record files start with a file header, followed by records made of a record header and the data.
+ * Values are in host byte order, and times are gtime values (the monotonic clock in nanoseconds).
+ */
+typedef struct
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+} s_record_file_header;
+
+typedef struct
+{
+  uint64_t time;
+  uint32_t size;
+  uint8_t direction; // ASYNC_RECORD_READ or ASYNC_RECORD_WRITE
+  uint8_t reserved[3];
+} s_record_header;
+
+/*
+ * A replay device is a timerfd, armed for the next recorded read.
+ */
+typedef struct
+{
+  const char * data; // mapped record file
+  size_t size;
+  size_t offset; // next record
+  double speed; // 0 to replay as fast as possible
+  gtime origin; // time of the first record
+  gtime start; // replay start time
+} s_replay;
+
+#define ASYNC_POOL_PATH_SIZE 256
+#define ASYNC_POOL_MAX_FDS 65536
+
+/*
+ * Packets read by a dedicated reader thread are passed to the poll loop through a single-producer single-consumer ring.
+ * The data of each packet is stored in the slot of the read buffer that has the same index.
+ */
+typedef struct
+{
+  int status;
+  int error; // errno value for failed reads
+} s_reader_packet;
+
+GRING_SPSC(reader, s_reader_packet, ASYNC_READER_RING_SIZE)
+
+struct async_reader {
+    gring_reader ring;
+    pthread_t thread;
+    int cpu; // the thread is pinned to this cpu, unless it is negative
+    int running;
+    int event; // eventfd signaled by the reader thread when the ring becomes non-empty
+    int stop; // eventfd signaled to stop the reader thread
+    char * buf; // ASYNC_READER_RING_SIZE slots of the read size, and a scratch slot
+    unsigned long long dropped; // packets dropped because the ring was full
+};
+
+/*
+ * The fields used to dispatch read events are grouped in the first cache line,
+ * and the fields updated for each delivered packet follow.
+ */
 struct async_device {
+    // read dispatch
     int fd;
-    char * path;
+    unsigned short dispatching; // user callbacks running for this device
+    unsigned char closed; // closed from a user callback, and freed once the callbacks returned
     struct
     {
       char * buf;
       unsigned int count;
-      unsigned int bread;
-      unsigned int size;
+      unsigned int size; // slot size
+      unsigned int slots;
+      unsigned char ring; // slots are lent to the user until released
+      unsigned char framed; // data is delivered frame by frame
+      unsigned char mode; // ASYNC_READ_MODE_*
+      unsigned int next; // next slot to fill in ring mode
+      unsigned int lent; // number of lent slots in ring mode
+      int * status; // read status of each slot, or length of the lent packet in ring mode
     } read;
     struct {
         void * user;
         ASYNC_READ_CALLBACK fp_read;
         ASYNC_WRITE_CALLBACK fp_write;
         ASYNC_CLOSE_CALLBACK fp_close;
+        ASYNC_REGISTER_SOURCE fp_register;
         ASYNC_REMOVE_SOURCE fp_remove;
     } callback;
+    // packet bookkeeping
+    struct timespec last_packet;
+    FILE * record; // record file, if recording
+    ASYNC_STATS stats;
+    // write path
+    unsigned int polled; // registered events (ASYNC_POLL_*)
+    struct
+    {
+      s_queue queue;
+      e_async_write_policy policy;
+      struct
+      {
+        char * buf;
+        unsigned int size; // 0 if coalescing is disabled
+        unsigned int count;
+        unsigned int window; // in microseconds, 0 to flush on the next poll iteration
+        int timer; // timerfd used when the window is not 0
+      } coalesce;
+    } write;
+#ifdef ASYNC_HAS_IO_URING
+    struct
+    {
+      int requested; // the io_uring engine is used once registered
+      int enabled;
+      int reading; // a read is posted
+      int writing; // a write is posted
+      unsigned int inflight; // posted operations, including cancellations
+    } uring;
+#endif
+    // cold
+    struct
+    {
+      ASYNC_FRAMING config;
+      char * buf;
+      unsigned int size;
+      unsigned int count;
+    } framing;
+    struct async_reader * reader; // dedicated reader thread, if enabled
+    e_async_device_type device_type;
+    ASYNC_WRITE_AT_CALLBACK fp_write_at; // reports the lateness of scheduled writes
+    struct async_pacer * pacer; // pacer of the poll loop, once a write was scheduled
+    unsigned int paced; // pending scheduled writes
+    s_replay * replay; // replayed record file, for replay devices
+    struct
+    {
+      unsigned int spin; // maximum spin time in microseconds, 0 if busy polling is disabled
+      gtime interval; // moving average of packet inter-arrival times
+      gtime last; // arrival time of the last packet
+    } busy_poll;
+    char * path;
     void * priv;
+    int pooled; // the device and its buffers belong to the pool
+    unsigned int refs; // one while the device is open, plus the references taken with async_acquire_device
+    unsigned int hash; // hash of the path
+    struct async_device * hnext; // next device in the path index bucket, or in the pool free list
     GLIST_LINK(struct async_device);
-};
+} __attribute__((aligned(ASYNC_CACHE_LINE_SIZE)));
+
+#define ASYNC_ASSERT_FIRST_LINE(FIELD) \
+    _Static_assert(offsetof(struct async_device, FIELD) < ASYNC_CACHE_LINE_SIZE, #FIELD " is out of the first cache line")
+
+ASYNC_ASSERT_FIRST_LINE(fd);
+ASYNC_ASSERT_FIRST_LINE(dispatching);
+ASYNC_ASSERT_FIRST_LINE(closed);
+ASYNC_ASSERT_FIRST_LINE(read.buf);
+ASYNC_ASSERT_FIRST_LINE(read.count);
+ASYNC_ASSERT_FIRST_LINE(read.mode);
+ASYNC_ASSERT_FIRST_LINE(callback.user);
+ASYNC_ASSERT_FIRST_LINE(callback.fp_read);
 
 static GLIST_INST(struct async_device, async_devices);
 
-static struct async_device * add_device(const char * path, int fd, int print) {
+/*
+ * Devices are indexed by path (chained hash table) and by fd (direct table).
+ *
+ * The device list, the indexes and the pool are modified under the registry lock,
+ * so that devices can be opened and closed from any thread.
+ * The fd index is read without locking: entries are accessed atomically, and when the table grows
+ * the previous one is retired instead of being freed, as a concurrent lookup may still use it.
+ *
+ * Device memory is reclaimed in two steps. Lock-free lookups announce themselves in one of two reader counts,
+ * selected by the parity of an epoch: once a device is removed from the fd index, the epoch is advanced,
+ * and the removal waits for the lookups counted with the previous parity, which may still see the device.
+ * Lookups that take a reference then delay the release of the device memory until the last reference is dropped.
+ */
+static pthread_mutex_t registry_mutex;
+static pthread_once_t registry_once = PTHREAD_ONCE_INIT;
 
-    struct async_device * current = GLIST_BEGIN(async_devices);
-    while (current != GLIST_END(async_devices)) {
-        if(current->path && !strcmp(current->path, path)) {
-            if(print) {
-                if (GLOG_LEVEL(GLOG_NAME,ERROR)) {
-                    fprintf(stderr, "%s:%d add_device %s: device already opened\n", __FILE__, __LINE__, path);
-                }
-            }
-            return NULL;
-        }
-        current = current->next;
-    }
+static struct {
+    unsigned int epoch;
+    unsigned int readers[2];
+} lookups;
 
-    struct async_device * device = calloc(1, sizeof(*device));
-    if (device == NULL) {
-        PRINT_ERROR_ALLOC_FAILED("calloc");
-        return NULL;
-    }
-    device->path = strdup(path);
-    if (device->path == NULL) {
-        PRINT_ERROR_OTHER("failed to duplicate path");
-        free(device);
-        return NULL;
-    }
-    device->fd = fd;
-    GLIST_ADD(async_devices, device);
-    return device;
+static struct {
+    struct async_device ** buckets;
+    unsigned int size; // power of two
+    unsigned int nb;
+} path_index;
+
+typedef struct fd_table {
+    unsigned int size;
+    struct fd_table * retired; // previous table
+    struct async_device * devices[];
+} s_fd_table;
+
+static s_fd_table * fd_index;
+
+/*
+ * Devices and read buffers can be preallocated, so that opening and closing devices does not allocate memory.
+ */
+static struct {
+    struct async_device * devices;
+    char * paths;
+    char * read_bufs;
+    int * status;
+    unsigned int capacity;
+    unsigned int read_size;
+    unsigned int slots;
+    struct async_device * free;
+} pool;
+
+static void registry_init(void) {
+
+    // recursive, so that async_for_each_device callbacks can close devices
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&registry_mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
 }
 
-struct async_device * async_open_path(const char * path, int print) {
+static void registry_lock(void) {
 
-    struct async_device * device = NULL;
-    if(path != NULL) {
-        int fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
-        if(fd != -1) {
-            device = add_device(path, fd, print);
-            if(device == NULL) {
-                close(fd);
-            }
-        }
-        else {
-            if(print) {
-                PRINT_ERROR_ERRNO("open");
-            }
-        }
-    }
-    return device;
+    pthread_once(&registry_once, registry_init);
+    pthread_mutex_lock(&registry_mutex);
 }
 
-int async_close(struct async_device * device) {
+static void registry_unlock(void) {
 
-    if (device->callback.fp_remove != NULL) {
-        device->callback.fp_remove(device->fd);
+    pthread_mutex_unlock(&registry_mutex);
+}
+
+/*
+ * This function waits until the lookups that started before devices were removed from the fd index complete.
+ * It must be called with the registry lock held.
+ */
+static void registry_synchronize(void) {
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST); // orders the removal before the reader count check
+
+    unsigned int slot = __atomic_fetch_add(&lookups.epoch, 1, __ATOMIC_SEQ_CST) & 1;
+
+    while (__atomic_load_n(&lookups.readers[slot], __ATOMIC_ACQUIRE) != 0) {
+        sched_yield();
     }
+}
 
-    close(device->fd);
+static int poll_update(struct async_device * device);
+static void free_device(struct async_device * device);
+static int flush_coalesced(struct async_device * device);
+static int write_queue(struct async_device * device);
+static int register_coalesce_timer(struct async_device * device);
+static void reader_stop(struct async_device * device);
+static void pacer_remove_device(struct async_device * device);
 
-    free(device->path);
-    free(device->read.buf);
+/*
+ * Statistics are updated after each I/O syscall, and when packets are delivered or written.
+ */
+static inline void stats_read(struct async_device * device, int res) {
 
-    GLIST_REMOVE(async_devices, device);
+    ++device->stats.read_calls;
+    if (res > 0) {
+        device->stats.bytes_read += res;
+    }
+    else if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        ++device->stats.eagain;
+    }
+}
 
-    free(device);
+static inline void stats_write(struct async_device * device, int res, size_t requested) {
 
-    return 0;
+    ++device->stats.write_calls;
+    if (res > 0) {
+        device->stats.bytes_written += res;
+        if ((size_t) res < requested) {
+            ++device->stats.short_writes;
+        }
+    }
+    else if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        ++device->stats.eagain;
+    }
 }
 
-int async_read_timeout(struct async_device * device, void * buf, unsigned int count, unsigned int timeout) {
+static inline void stats_packet(struct async_device * device) {
 
-  unsigned int bread = 0;
-  int res;
+    ++device->stats.packets_read;
+#ifdef CLOCK_MONOTONIC_COARSE
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &device->last_packet);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &device->last_packet);
+#endif
+}
 
-  fd_set readfds;
+static void record_io(struct async_device * device, uint8_t direction, const struct iovec * iov, int iovcnt, unsigned int count) {
 
-  time_t sec = timeout / 1000;
-  __suseconds_t usec = (timeout - sec * 1000) * 1000;
-  struct timeval tv = {.tv_sec = sec, .tv_usec = usec};
+    s_record_header header = { .time = gtime_gettime(), .size = count, .direction = direction };
 
-  while(bread != count)
-  {
-    FD_ZERO(&readfds);
-    FD_SET(device->fd, &readfds);
-    int status = select(device->fd+1, &readfds, NULL, NULL, &tv);
-    if(status > 0)
-    {
-      if(FD_ISSET(device->fd, &readfds))
-      {
-        res = read(device->fd, buf+bread, count-bread);
-        if(res > 0)
-        {
-          bread += res;
+    int ok = (fwrite(&header, sizeof(header), 1, device->record) == 1);
+
+    int i;
+    for (i = 0; ok && i < iovcnt; ++i) {
+        if (iov[i].iov_len > 0 && fwrite(iov[i].iov_base, iov[i].iov_len, 1, device->record) != 1) {
+            ok = 0;
         }
-      }
-    }
-    else if (status < 0)
-    {
-      if(errno == EINTR)
-      {
-        continue;
-      }
-      PRINT_ERROR_ERRNO("select");
     }
-    else
-    {
-      break; // timeout
+
+    if (!ok) {
+        PRINT_ERROR_ERRNO("fwrite");
+        fclose(device->record);
+        device->record = NULL; // stop recording
     }
-  }
+}
 
-  return bread;
+/*
+ * This function is called for each packet delivered to fp_read.
+ */
+static inline void packet_read(struct async_device * device, const void * buf, int length) {
+
+    stats_packet(device);
+
+    if (device->record != NULL) {
+        struct iovec iov = { .iov_base = (void *) buf, .iov_len = length };
+        record_io(device, ASYNC_RECORD_READ, &iov, 1, length);
+    }
 }
 
-int async_write_timeout(struct async_device * device, const void * buf, unsigned int count, unsigned int timeout) {
+static unsigned int hash_path(const char * path) {
 
-  unsigned int bwritten = 0;
-  int res;
+    unsigned int hash = 2166136261u; // FNV-1a
+    while (*path != '\0') {
+        hash ^= (unsigned char) *path++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
 
-  fd_set writefds;
+static struct async_device * path_index_find(const char * path, unsigned int hash) {
 
-  time_t sec = timeout / 1000;
-  __suseconds_t usec = (timeout - sec * 1000) * 1000;
-  struct timeval tv = {.tv_sec = sec, .tv_usec = usec};
+    if (path_index.size == 0) {
+        return NULL;
+    }
 
-  while(bwritten != count)
-  {
-    FD_ZERO(&writefds);
-    FD_SET(device->fd, &writefds);
-    int status = select(device->fd+1, NULL, &writefds, NULL, &tv);
-    if(status > 0)
-    {
-      if(FD_ISSET(device->fd, &writefds))
-      {
-        res = write(device->fd, buf+bwritten, count-bwritten);
-        if(res > 0)
-        {
-          bwritten += res;
+    struct async_device * current = path_index.buckets[hash & (path_index.size - 1)];
+    while (current != NULL) {
+        if (current->hash == hash && !strcmp(current->path, path)) {
+            return current;
         }
-      }
+        current = current->hnext;
     }
-    else if(errno == EINTR)
-    {
-      continue;
+    return NULL;
+}
+
+static int path_index_grow(void) {
+
+    unsigned int size = path_index.size ? path_index.size * 2 : ASYNC_INDEX_MIN_SIZE;
+    struct async_device ** buckets = calloc(size, sizeof(*buckets));
+    if (buckets == NULL) {
+        PRINT_ERROR_ALLOC_FAILED("calloc");
+        return -1;
     }
-    else
-    {
-      PRINT_ERROR_ERRNO("select");
-      break;
+
+    unsigned int i;
+    for (i = 0; i < path_index.size; ++i) {
+        struct async_device * current = path_index.buckets[i];
+        while (current != NULL) {
+            struct async_device * next = current->hnext;
+            current->hnext = buckets[current->hash & (size - 1)];
+            buckets[current->hash & (size - 1)] = current;
+            current = next;
+        }
     }
-  }
 
-  return bwritten;
+    free(path_index.buckets);
+    path_index.buckets = buckets;
+    path_index.size = size;
+    return 0;
 }
 
-/*
- * This function is called on data reception.
- */
-static int read_callback(void * user) {
+static int path_index_add(struct async_device * device) {
 
-    struct async_device * device = (struct async_device *) user;
+    if (path_index.nb >= path_index.size) {
+        if (path_index_grow() < 0 && path_index.size == 0) {
+            return -1; // a higher load is fine, an empty table is not
+        }
+    }
 
-    int ret = read(device->fd, device->read.buf, device->read.count);
+    struct async_device ** bucket = path_index.buckets + (device->hash & (path_index.size - 1));
+    device->hnext = *bucket;
+    *bucket = device;
+    ++path_index.nb;
+    return 0;
+}
 
-    if(ret < 0) {
-        PRINT_ERROR_ERRNO("read");
-    }
+static void path_index_remove(struct async_device * device) {
 
-    return device->callback.fp_read(device->callback.user, (const char *)device->read.buf, ret);
+    struct async_device ** current = path_index.buckets + (device->hash & (path_index.size - 1));
+    while (*current != NULL) {
+        if (*current == device) {
+            *current = device->hnext;
+            --path_index.nb;
+            return;
+        }
+        current = &(*current)->hnext;
+    }
 }
 
 /*
- * This function is called on failure.
+ * This function must be called with the registry lock held.
  */
-static int close_callback(void * user) {
-
-    struct async_device * device = (struct async_device *) user;
-
-    return device->callback.fp_close(device->callback.user);
-}
+static int fd_index_set(int fd, struct async_device * device) {
 
-int async_set_read_size(struct async_device * device, unsigned int size) {
+    s_fd_table * table = fd_index;
 
-    if(size > device->read.size) {
-        void * ptr = realloc(device->read.buf, size);
-        if(ptr == NULL) {
-            PRINT_ERROR_ALLOC_FAILED("realloc");
+    if (table == NULL || (unsigned int) fd >= table->size) {
+        unsigned int size = table ? table->size : ASYNC_INDEX_MIN_SIZE;
+        while (size <= (unsigned int) fd) {
+            size *= 2;
+        }
+        s_fd_table * grown = calloc(1, sizeof(*grown) + size * sizeof(*grown->devices));
+        if (grown == NULL) {
+            PRINT_ERROR_ALLOC_FAILED("calloc");
             return -1;
         }
-        device->read.buf = ptr;
-        device->read.size = size;
+        grown->size = size;
+        if (table != NULL) {
+            memcpy(grown->devices, table->devices, table->size * sizeof(*table->devices));
+            grown->retired = table;
+        }
+        __atomic_store_n(&fd_index, grown, __ATOMIC_RELEASE);
+        table = grown;
     }
 
-    device->read.count = size;
-
+    __atomic_store_n(&table->devices[fd], device, __ATOMIC_RELEASE);
     return 0;
 }
 
-int async_register(struct async_device * device, void * user, const ASYNC_CALLBACKS * callbacks) {
+/*
+ * This function must be called with the registry lock held.
+ */
+static struct async_device * alloc_device(const char * path) {
 
-    if (callbacks->fp_remove == NULL) {
-        PRINT_ERROR_OTHER("fp_remove is NULL");
+    struct async_device * device;
+
+    if (pool.capacity > 0) {
+        if (strlen(path) >= ASYNC_POOL_PATH_SIZE) {
+            PRINT_ERROR_OTHER("path is too long for the pool");
+            return NULL;
+        }
+        device = pool.free;
+        if (device == NULL) {
+            PRINT_ERROR_OTHER("no device left in the pool");
+            return NULL;
+        }
+        pool.free = device->hnext;
+        unsigned int index = device - pool.devices;
+        memset(device, 0x00, sizeof(*device));
+        device->pooled = 1;
+        device->refs = 1;
+        device->path = strcpy(pool.paths + index * ASYNC_POOL_PATH_SIZE, path);
+        device->read.buf = pool.read_bufs + (size_t) index * pool.slots * pool.read_size;
+        device->read.status = pool.status + index * pool.slots;
+        return device;
     }
 
-    if (callbacks->fp_register == NULL) {
-        PRINT_ERROR_OTHER("fp_register is NULL");
+    device = aligned_alloc(ASYNC_CACHE_LINE_SIZE, sizeof(*device));
+    if (device == NULL) {
+        PRINT_ERROR_ALLOC_FAILED("aligned_alloc");
+        return NULL;
     }
+    memset(device, 0x00, sizeof(*device));
+    device->refs = 1;
+    device->path = strdup(path);
+    if (device->path == NULL) {
+        PRINT_ERROR_OTHER("failed to duplicate path");
+        free(device);
+        return NULL;
+    }
+    return device;
+}
 
-    device->callback.user = user;
-    device->callback.fp_read = callbacks->fp_read;
-    //fp_write is ignored
-    device->callback.fp_close = callbacks->fp_close;
-    device->callback.fp_remove = callbacks->fp_remove;
+static struct async_device * add_device(const char * path, int fd, int print) {
 
-    GPOLL_CALLBACKS gpoll_callbacks = {
-            .fp_read = read_callback,
-            .fp_write = NULL,
-            .fp_close = close_callback,
-    };
-    return callbacks->fp_register(device->fd, device, &gpoll_callbacks);
-}
+    unsigned int hash = hash_path(path);
 
-int async_write(struct async_device * device, const void * buf, unsigned int count) {
+    registry_lock();
 
-    int ret = write(device->fd, buf, count);
-    if (ret == -1) {
-        PRINT_ERROR_ERRNO("write");
-    }
-    else if((unsigned int) ret != count) {
-        if (GLOG_LEVEL(GLOG_NAME,ERROR)) {
-            fprintf(stderr, "%s:%d write: only %u written (requested %u)\n", __FILE__, __LINE__, ret, count);
+    if (path_index_find(path, hash) != NULL) {
+        registry_unlock();
+        if(print) {
+            if (GLOG_LEVEL(GLOG_NAME,ERROR)) {
+                fprintf(stderr, "%s:%d add_device %s: device already opened\n", __FILE__, __LINE__, path);
+            }
         }
+        return NULL;
     }
 
-    return ret;
+    struct async_device * device = alloc_device(path);
+    if (device == NULL) {
+        registry_unlock();
+        return NULL;
+    }
+    device->fd = fd;
+    device->hash = hash;
+    device->write.coalesce.timer = -1;
+    if (fd_index_set(fd, device) < 0) {
+        registry_unlock();
+        free_device(device);
+        return NULL;
+    }
+    if (path_index_add(device) < 0) {
+        fd_index_set(fd, NULL);
+        registry_synchronize();
+        registry_unlock();
+        free_device(device);
+        return NULL;
+    }
+    GLIST_ADD(async_devices, device);
+
+    registry_unlock();
+
+    return device;
 }
 
-int async_get_fd(struct async_device * device) {
+static void remove_device(struct async_device * device) {
+
+    registry_lock();
+    path_index_remove(device);
+    fd_index_set(device->fd, NULL);
+    GLIST_REMOVE(async_devices, device);
+    registry_synchronize();
+    registry_unlock();
+}
+
+static int iov_count(const struct iovec * iov, int iovcnt, unsigned int * count) {
+
+    if (iovcnt < 0) {
+        PRINT_ERROR_OTHER("invalid vector count");
+        return -1;
+    }
+
+    size_t total = 0;
+    int i;
+    for (i = 0; i < iovcnt; ++i) {
+        total += iov[i].iov_len;
+        if (total > INT_MAX) {
+            PRINT_ERROR_OTHER("vector is too large");
+            return -1;
+        }
+    }
+    *count = total;
+    return 0;
+}
+
+/*
+ * This function writes the vector starting at element 'index' and 'offset' bytes in this element.
+ * A partially written element is completed with write, so that the caller's vector is never modified.
+ */
+static int writev_offset(int fd, const struct iovec * iov, int iovcnt, int index, size_t offset) {
+
+    if (offset > 0) {
+        return write(fd, (const char *) iov[index].iov_base + offset, iov[index].iov_len - offset);
+    }
+
+    int nb = iovcnt - index;
+    if (nb > IOV_MAX) {
+        nb = IOV_MAX;
+    }
+    return writev(fd, iov + index, nb);
+}
+
+static void iov_advance(const struct iovec * iov, int iovcnt, size_t written, int * index, size_t * offset) {
+
+    written += *offset;
+    while (*index < iovcnt && written >= iov[*index].iov_len) {
+        written -= iov[*index].iov_len;
+        ++*index;
+    }
+    *offset = written;
+}
+
+/*
+ * The head of the queue can't be dropped or replaced once writing it started.
+ */
+static unsigned int queue_first_pending(struct async_device * device) {
+
+  if(device->write.queue.nb > 0 && (device->write.queue.data[0].offset > 0
+#ifdef ASYNC_HAS_IO_URING
+      || device->uring.writing
+#endif
+      )) {
+      return 1;
+  }
+  return 0;
+}
+
+/*
+ * The vector is queued as a contiguous buffer, and writing resumes at the given offset.
+ * When the queue is full the oldest pending write is dropped with E_ASYNC_WRITE_POLICY_DROP_OLDEST.
+ * With E_ASYNC_WRITE_POLICY_REPLACE the last pending write is overwritten in place.
+ */
+static int queue_write(struct async_device * device, const struct iovec * iov, int iovcnt, unsigned int count, unsigned int offset) {
+  unsigned int first = queue_first_pending(device);
+  unsigned int index = device->write.queue.nb;
+  if(device->write.policy == E_ASYNC_WRITE_POLICY_REPLACE && index > first) {
+      --index; // replace the last pending write
+      ++device->stats.dropped_writes;
+  }
+  else if(index == ASYNC_MAX_WRITE_QUEUE_SIZE) {
+      if(device->write.policy != E_ASYNC_WRITE_POLICY_DROP_OLDEST || first == index) {
+          if (GLOG_LEVEL(GLOG_NAME,ERROR)) {
+              fprintf(stderr, "%s:%d %s: no space left in write queue for device (%s)\n", __FILE__, __LINE__, __func__, device->path);
+          }
+          return -1;
+      }
+      ++device->stats.dropped_writes;
+      free(device->write.queue.data[first].buf);
+      memmove(device->write.queue.data + first, device->write.queue.data + first + 1, (index - first - 1) * sizeof(*device->write.queue.data));
+      --device->write.queue.nb;
+      --index;
+      device->write.queue.data[index].buf = NULL;
+      device->write.queue.data[index].size = 0;
+  }
+  else {
+      device->write.queue.data[index].buf = NULL;
+      device->write.queue.data[index].size = 0;
+  }
+  char * dup = device->write.queue.data[index].buf;
+  if(count > device->write.queue.data[index].size) {
+      dup = realloc(dup, count);
+      if(!dup) {
+          PRINT_ERROR_ALLOC_FAILED("realloc");
+          return -1;
+      }
+      device->write.queue.data[index].buf = dup;
+      device->write.queue.data[index].size = count;
+  }
+  unsigned int copied = 0;
+  int i;
+  for (i = 0; i < iovcnt; ++i) {
+      memcpy(dup + copied, iov[i].iov_base, iov[i].iov_len);
+      copied += iov[i].iov_len;
+  }
+  device->write.queue.data[index].count = count;
+  device->write.queue.data[index].offset = offset;
+  if(index == device->write.queue.nb) {
+      ++device->write.queue.nb;
+      if(device->write.queue.nb > device->stats.queue_high_water) {
+          device->stats.queue_high_water = device->write.queue.nb;
+      }
+  }
+  return index;
+}
+
+static int dequeue_write(struct async_device * device) {
+  if(device->write.queue.nb > 0) {
+      --device->write.queue.nb;
+      free(device->write.queue.data[0].buf);
+      memmove(device->write.queue.data, device->write.queue.data + 1, device->write.queue.nb * sizeof(*device->write.queue.data));
+  }
+  return device->write.queue.nb - 1;
+}
+
+/*
+ * User callbacks may close the device they are called for.
+ * The device is then freed once the callbacks running for it returned,
+ * and the dispatch loops check the 'closed' flag after each callback.
+ */
+static inline void dispatch_begin(struct async_device * device) {
+
+    ++device->dispatching;
+}
+
+/*
+ * Returns 1 if the device was closed, in which case it must not be accessed anymore.
+ */
+static int dispatch_end(struct async_device * device) {
+
+    if (--device->dispatching > 0 || !device->closed) {
+        return device->closed;
+    }
+
+#ifdef ASYNC_HAS_IO_URING
+    if (device->uring.inflight > 0) {
+        return 1; // freed by uring_complete
+    }
+#endif
+
+    free_device(device);
+    return 1;
+}
+
+#ifdef ASYNC_HAS_IO_URING
+/*
+ * The io_uring engine.
+ *
+ * A single ring is shared by all the devices using this engine. The ring fd is registered
+ * to the event sources of the first registered device, and completions are dispatched from its read callback.
+ * A read is kept posted for each device, and queued writes are submitted one at a time.
+ */
+
+#define ASYNC_URING_ENTRIES 256
+
+#define ASYNC_URING_OP_READ   0x00
+#define ASYNC_URING_OP_WRITE  0x01
+#define ASYNC_URING_OP_CANCEL 0x02
+#define ASYNC_URING_OP_MASK   0x03ULL
+
+#define ASYNC_URING_REAPED    0x00ULL // user data of completions consumed in place
+
+static struct {
+    int fd;
+    unsigned int users; // devices using the ring, including closed devices with pending operations
+    unsigned int to_submit;
+    struct {
+        unsigned int * head;
+        unsigned int * tail;
+        unsigned int * mask;
+        unsigned int * array;
+        unsigned int entries;
+        struct io_uring_sqe * sqes;
+    } sq;
+    struct {
+        unsigned int * head;
+        unsigned int * tail;
+        unsigned int * mask;
+        struct io_uring_cqe * cqes;
+    } cq;
+    void * sq_ptr;
+    size_t sq_size;
+    void * cq_ptr;
+    size_t cq_size;
+    size_t sqes_size;
+    ASYNC_REMOVE_SOURCE fp_remove;
+} uring = { .fd = -1 };
+
+static void uring_unmap(void) {
+
+    if (uring.sqes_size) {
+        munmap(uring.sq.sqes, uring.sqes_size);
+    }
+    if (uring.cq_ptr != NULL && uring.cq_ptr != uring.sq_ptr) {
+        munmap(uring.cq_ptr, uring.cq_size);
+    }
+    if (uring.sq_ptr != NULL) {
+        munmap(uring.sq_ptr, uring.sq_size);
+    }
+    close(uring.fd);
+    memset(&uring, 0x00, sizeof(uring));
+    uring.fd = -1;
+}
+
+static int uring_init(void) {
+
+    struct io_uring_params params;
+    memset(&params, 0x00, sizeof(params));
+
+    int fd = syscall(__NR_io_uring_setup, ASYNC_URING_ENTRIES, &params);
+    if (fd < 0) {
+        if (GLOG_LEVEL(GLOG_NAME,INFO)) {
+            fprintf(stderr, "%s:%d %s: io_uring is not available: %m\n", __FILE__, __LINE__, __func__);
+        }
+        return -1;
+    }
+
+    uring.fd = fd;
+
+    uring.sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    uring.cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (uring.cq_size > uring.sq_size) {
+            uring.sq_size = uring.cq_size;
+        }
+        uring.cq_size = uring.sq_size;
+    }
+
+    uring.sq_ptr = mmap(NULL, uring.sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (uring.sq_ptr == MAP_FAILED) {
+        PRINT_ERROR_ERRNO("mmap");
+        uring.sq_ptr = NULL;
+        uring_unmap();
+        return -1;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        uring.cq_ptr = uring.sq_ptr;
+    }
+    else {
+        uring.cq_ptr = mmap(NULL, uring.cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (uring.cq_ptr == MAP_FAILED) {
+            PRINT_ERROR_ERRNO("mmap");
+            uring.cq_ptr = NULL;
+            uring_unmap();
+            return -1;
+        }
+    }
+
+    uring.sq.sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (uring.sq.sqes == MAP_FAILED) {
+        PRINT_ERROR_ERRNO("mmap");
+        uring_unmap();
+        return -1;
+    }
+    uring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    uring.sq.head = (unsigned int *) ((char *) uring.sq_ptr + params.sq_off.head);
+    uring.sq.tail = (unsigned int *) ((char *) uring.sq_ptr + params.sq_off.tail);
+    uring.sq.mask = (unsigned int *) ((char *) uring.sq_ptr + params.sq_off.ring_mask);
+    uring.sq.array = (unsigned int *) ((char *) uring.sq_ptr + params.sq_off.array);
+    uring.sq.entries = params.sq_entries;
+
+    uring.cq.head = (unsigned int *) ((char *) uring.cq_ptr + params.cq_off.head);
+    uring.cq.tail = (unsigned int *) ((char *) uring.cq_ptr + params.cq_off.tail);
+    uring.cq.mask = (unsigned int *) ((char *) uring.cq_ptr + params.cq_off.ring_mask);
+    uring.cq.cqes = (struct io_uring_cqe *) ((char *) uring.cq_ptr + params.cq_off.cqes);
+
+    return 0;
+}
+
+static int uring_submit(void) {
+
+    while (uring.to_submit > 0) {
+        int ret = syscall(__NR_io_uring_enter, uring.fd, uring.to_submit, 0, 0, NULL, 0);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            PRINT_ERROR_ERRNO("io_uring_enter");
+            return -1;
+        }
+        uring.to_submit -= ret;
+    }
+
+    return 0;
+}
+
+static struct io_uring_sqe * uring_get_sqe(void) {
+
+    unsigned int tail = *uring.sq.tail;
+    if (tail - __atomic_load_n(uring.sq.head, __ATOMIC_ACQUIRE) == uring.sq.entries) {
+        PRINT_ERROR_OTHER("io_uring submission queue is full");
+        return NULL;
+    }
+
+    struct io_uring_sqe * sqe = uring.sq.sqes + (tail & *uring.sq.mask);
+    memset(sqe, 0x00, sizeof(*sqe));
+    return sqe;
+}
+
+static int uring_push_sqe(struct io_uring_sqe * sqe) {
+
+    unsigned int tail = *uring.sq.tail;
+    uring.sq.array[tail & *uring.sq.mask] = sqe - uring.sq.sqes;
+    __atomic_store_n(uring.sq.tail, tail + 1, __ATOMIC_RELEASE);
+    ++uring.to_submit;
+    return uring_submit();
+}
+
+static int uring_post(struct async_device * device, __u8 opcode, unsigned int op, void * buf, unsigned int count) {
+
+    struct io_uring_sqe * sqe = uring_get_sqe();
+    if (sqe == NULL) {
+        return -1;
+    }
+
+    sqe->opcode = opcode;
+    sqe->fd = device->fd;
+    sqe->addr = (uintptr_t) buf;
+    sqe->len = count;
+    sqe->off = (__u64) -1; // current position, or none for stream devices
+    sqe->user_data = (uintptr_t) device | op;
+
+    ++device->uring.inflight;
+
+    return uring_push_sqe(sqe);
+}
+
+static int uring_post_read(struct async_device * device) {
+
+    if (uring_post(device, IORING_OP_READ, ASYNC_URING_OP_READ, device->read.buf, device->read.count) < 0) {
+        return -1;
+    }
+    device->uring.reading = 1;
+    return 0;
+}
+
+static int uring_post_write(struct async_device * device) {
+
+    unsigned int offset = device->write.queue.data[0].offset;
+    if (uring_post(device, IORING_OP_WRITE, ASYNC_URING_OP_WRITE, device->write.queue.data[0].buf + offset,
+            device->write.queue.data[0].count - offset) < 0) {
+        return -1;
+    }
+    device->uring.writing = 1;
+    return 0;
+}
+
+static int uring_cancel(struct async_device * device, unsigned int op) {
+
+    struct io_uring_sqe * sqe = uring_get_sqe();
+    if (sqe == NULL) {
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (uintptr_t) device | op;
+    sqe->user_data = (uintptr_t) device | ASYNC_URING_OP_CANCEL;
+
+    ++device->uring.inflight;
+
+    return uring_push_sqe(sqe);
+}
+
+/*
+ * Wait until the operations posted for a device complete.
+ * Its completions are consumed in place, as completions of other devices may precede them
+ * in the completion queue: these are left for uring_callback.
+ */
+static int uring_reap(struct async_device * device) {
+
+    while (device->uring.inflight > 0) {
+        unsigned int head = *uring.cq.head;
+        unsigned int tail = __atomic_load_n(uring.cq.tail, __ATOMIC_ACQUIRE);
+        unsigned int i;
+        for (i = head; i != tail; ++i) {
+            struct io_uring_cqe * cqe = uring.cq.cqes + (i & *uring.cq.mask);
+            if (cqe->user_data != ASYNC_URING_REAPED
+                    && (cqe->user_data & ~ASYNC_URING_OP_MASK) == (uintptr_t) device) {
+                cqe->user_data = ASYNC_URING_REAPED;
+                --device->uring.inflight;
+            }
+        }
+        while (head != tail && uring.cq.cqes[head & *uring.cq.mask].user_data == ASYNC_URING_REAPED) {
+            ++head;
+        }
+        __atomic_store_n(uring.cq.head, head, __ATOMIC_RELEASE);
+        if (device->uring.inflight == 0) {
+            break;
+        }
+        // wait for one more completion
+        if (syscall(__NR_io_uring_enter, uring.fd, 0, tail - head + 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+            PRINT_ERROR_ERRNO("io_uring_enter");
+            return -1;
+        }
+    }
+
+    device->uring.reading = 0;
+    device->uring.writing = 0;
+
+    return 0;
+}
+
+static void uring_release(void) {
+
+    if (--uring.users == 0) {
+        if (uring.fp_remove != NULL) {
+            uring.fp_remove(uring.fd);
+        }
+        uring_unmap();
+    }
+}
+
+/*
+ * Completions are reported as in the poll engine: fp_read receives the read status,
+ * which is 0 at the end of file and -1 on error. No more read is posted in these cases.
+ */
+static int uring_read_complete(struct async_device * device, int res) {
+
+    if (res < 0) {
+        errno = -res;
+        PRINT_ERROR_ERRNO("read");
+    }
+
+    stats_read(device, res < 0 ? -1 : res);
+    if (res > 0) {
+        packet_read(device, device->read.buf, res);
+    }
+
+    dispatch_begin(device);
+
+    int ret = device->callback.fp_read(device->callback.user, (const char *)device->read.buf, res < 0 ? -1 : res);
+
+    if (dispatch_end(device)) {
+        return ret;
+    }
+
+    if (res > 0 && uring_post_read(device) < 0) {
+        ret = -1;
+    }
+
+    return ret;
+}
+
+static int uring_write_complete(struct async_device * device, int res) {
+
+    int status;
+    unsigned int remaining = device->write.queue.data[0].count - device->write.queue.data[0].offset;
+
+    if (res < 0) {
+        errno = -res;
+    }
+    stats_write(device, res, remaining);
+
+    if (res < 0) {
+        PRINT_ERROR_ERRNO("write");
+        status = -1;
+    }
+    else if (res == 0 && remaining > 0) {
+        PRINT_ERROR_OTHER("write did not make progress");
+        status = -1;
+    }
+    else {
+        device->write.queue.data[0].offset += res;
+        if (device->write.queue.data[0].offset < device->write.queue.data[0].count) {
+            return uring_post_write(device);
+        }
+        status = device->write.queue.data[0].count;
+        ++device->stats.packets_written;
+    }
+
+    dequeue_write(device);
+
+    int ret = 0;
+
+    if (device->write.queue.nb > 0) {
+        ret = uring_post_write(device);
+    }
+
+    if (device->callback.fp_write != NULL) {
+        dispatch_begin(device);
+        device->callback.fp_write(device->callback.user, status);
+        dispatch_end(device);
+    }
+
+    return status < 0 ? -1 : ret;
+}
+
+static int uring_complete(struct async_device * device, unsigned int op, int res) {
+
+    --device->uring.inflight;
+
+    switch (op) {
+    case ASYNC_URING_OP_READ:
+        device->uring.reading = 0;
+        break;
+    case ASYNC_URING_OP_WRITE:
+        device->uring.writing = 0;
+        break;
+    }
+
+    if (device->closed) {
+        // the completions could not be reaped when the device was closed
+        if (device->uring.inflight == 0 && device->dispatching == 0) {
+            free_device(device);
+        }
+        return 0;
+    }
+
+    switch (op) {
+    case ASYNC_URING_OP_READ:
+        return uring_read_complete(device, res);
+    case ASYNC_URING_OP_WRITE:
+        return uring_write_complete(device, res);
+    }
+
+    return 0;
+}
+
+/*
+ * This function is called when completions are available.
+ */
+static int uring_callback(void * user __attribute__((unused))) {
+
+    int ret = 0;
+    int fd = uring.fd;
+
+    // callbacks may close devices, which consumes their completions, or release the ring
+    while (uring.fd == fd) {
+        unsigned int head = *uring.cq.head;
+        if (head == __atomic_load_n(uring.cq.tail, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        struct io_uring_cqe * cqe = uring.cq.cqes + (head & *uring.cq.mask);
+        __u64 user_data = cqe->user_data;
+        int res = cqe->res;
+        __atomic_store_n(uring.cq.head, head + 1, __ATOMIC_RELEASE);
+        if (user_data == ASYNC_URING_REAPED) {
+            continue;
+        }
+
+        struct async_device * device = (struct async_device *) (uintptr_t) (user_data & ~ASYNC_URING_OP_MASK);
+        int status = uring_complete(device, user_data & ASYNC_URING_OP_MASK, res);
+        if (status != 0) {
+            ret = status;
+        }
+    }
+
+    return ret;
+}
+
+static int uring_close_callback(void * user __attribute__((unused))) {
+
+    PRINT_ERROR_OTHER("io_uring failure");
+
+    return -1;
+}
+
+/*
+ * This function switches a device to the io_uring engine, creating and registering the ring if needed.
+ */
+static int uring_register(struct async_device * device) {
+
+    // blocking operations are handled asynchronously by io_uring, while non-blocking ones would fail with EAGAIN
+    int flags = fcntl(device->fd, F_GETFL);
+    if (flags == -1 || fcntl(device->fd, F_SETFL, flags & ~O_NONBLOCK) == -1) {
+        PRINT_ERROR_ERRNO("fcntl");
+        return -1;
+    }
+
+    if (uring.fd < 0) {
+        int ret = uring_init();
+        if (ret == 0) {
+            GPOLL_CALLBACKS gpoll_callbacks = {
+                    .fp_read = uring_callback,
+                    .fp_write = NULL,
+                    .fp_close = uring_close_callback,
+            };
+            ret = device->callback.fp_register(uring.fd, NULL, &gpoll_callbacks);
+            if (ret < 0) {
+                uring_unmap();
+            }
+        }
+        if (ret < 0) {
+            fcntl(device->fd, F_SETFL, flags);
+            return -1;
+        }
+        uring.fp_remove = device->callback.fp_remove;
+    }
+
+    ++uring.users;
+    device->uring.enabled = 1;
+
+    if (device->callback.fp_read != NULL && device->read.count > 0) {
+        if (uring_post_read(device) < 0) {
+            return -1;
+        }
+    }
+
+    if (device->write.queue.nb > 0) {
+        return uring_post_write(device);
+    }
+
+    return 0;
+}
+#endif
+
+/*
+ * Devices can be opened and closed from any thread. A registered device is accessed by the thread
+ * running the poll loop, and it has to be closed from that thread, as event sources are not thread-safe.
+ */
+struct async_device * async_open_path(const char * path, int print) {
+
+    struct async_device * device = NULL;
+    if(path != NULL) {
+        int fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+        if(fd != -1) {
+            device = add_device(path, fd, print);
+            if(device == NULL) {
+                close(fd);
+            }
+        }
+        else {
+            if(print) {
+                PRINT_ERROR_ERRNO("open");
+            }
+        }
+    }
+    return device;
+}
+
+/*
+ * The device memory and its path are released with the last reference.
+ */
+static void release_device(struct async_device * device) {
+
+    if (__atomic_sub_fetch(&device->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+        return;
+    }
+
+    if (device->pooled) {
+        registry_lock();
+        device->hnext = pool.free;
+        pool.free = device;
+        registry_unlock();
+        return;
+    }
+
+    free(device->path);
+    free(device);
+}
+
+static void free_device(struct async_device * device) {
+
+    while(dequeue_write(device) != -1) ;
+
+    free(device->write.coalesce.buf);
+    free(device->framing.buf);
+    if (device->replay != NULL) {
+        munmap((void *) device->replay->data, device->replay->size);
+        free(device->replay);
+    }
+    if (device->write.coalesce.timer >= 0) {
+        close(device->write.coalesce.timer);
+    }
+
+#ifdef ASYNC_HAS_IO_URING
+    if (device->uring.enabled) {
+        uring_release();
+    }
+#endif
+
+    if (!device->pooled) {
+        free(device->read.buf);
+        free(device->read.status);
+    }
+
+    release_device(device);
+}
+
+int async_close(struct async_device * device) {
+
+    flush_coalesced(device);
+
+    if (device->record != NULL) {
+        async_set_record(device, NULL);
+    }
+
+    if (device->callback.fp_remove != NULL) {
+        if (device->polled != 0) {
+            device->callback.fp_remove(device->fd);
+        }
+        if (device->write.coalesce.timer >= 0) {
+            device->callback.fp_remove(device->write.coalesce.timer);
+        }
+    }
+
+    if (device->reader != NULL) {
+        reader_stop(device);
+    }
+
+    pacer_remove_device(device);
+
+    remove_device(device);
+
+    close(device->fd);
+
+#ifdef ASYNC_HAS_IO_URING
+    if (device->uring.inflight > 0) {
+        // buffers are in use until the posted operations complete:
+        // wait for the cancellations, as the poll loop may not run anymore
+        int ret = 0;
+        if (device->uring.reading && uring_cancel(device, ASYNC_URING_OP_READ) < 0) {
+            ret = -1;
+        }
+        if (device->uring.writing && uring_cancel(device, ASYNC_URING_OP_WRITE) < 0) {
+            ret = -1;
+        }
+        if (ret == 0) {
+            uring_reap(device);
+        }
+    }
+#endif
+
+    if (device->dispatching > 0
+#ifdef ASYNC_HAS_IO_URING
+            || device->uring.inflight > 0 // freed by uring_complete
+#endif
+            ) {
+        device->closed = 1;
+        return 0;
+    }
+
+    free_device(device);
+
+    return 0;
+}
+
+static void get_deadline(struct timespec * deadline, unsigned int timeout) {
+
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += timeout / 1000;
+    deadline->tv_nsec += (timeout % 1000) * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_nsec -= 1000000000L;
+        ++deadline->tv_sec;
+    }
+}
+
+/*
+ * This function waits until the device is ready for the requested events, or until the deadline.
+ * Returns 1 if the device is ready, 0 if the deadline expired, or -1 on failure.
+ */
+static int wait_deadline(struct async_device * device, short events, const struct timespec * deadline) {
+
+    struct pollfd pfd = { .fd = device->fd, .events = events };
+
+    while (1) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        struct timespec remaining = {
+            .tv_sec = deadline->tv_sec - now.tv_sec,
+            .tv_nsec = deadline->tv_nsec - now.tv_nsec
+        };
+        if (remaining.tv_nsec < 0) {
+            remaining.tv_nsec += 1000000000L;
+            --remaining.tv_sec;
+        }
+        if (remaining.tv_sec < 0) {
+            remaining.tv_sec = 0;
+            remaining.tv_nsec = 0;
+        }
+
+        int status = ppoll(&pfd, 1, &remaining, NULL);
+        if (status < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            PRINT_ERROR_ERRNO("ppoll");
+            return -1;
+        }
+        if (status == 0) {
+            return 0;
+        }
+        if (pfd.revents & events) {
+            return 1;
+        }
+        PRINT_ERROR_OTHER("device error or hang up");
+        return -1;
+    }
+}
+
+/*
+ * This function writes the queued data until the queue is empty or until the deadline,
+ * so that a synchronous write does not overtake pending asynchronous writes.
+ * Returns 1 once the queue is empty, 0 if the deadline expired, or -1 on failure.
+ */
+static int drain_queue(struct async_device * device, const struct timespec * deadline) {
+
+#ifdef ASYNC_HAS_IO_URING
+    if (device->uring.enabled) {
+        // the queue is owned by the posted writes
+        PRINT_ERROR_OTHER("asynchronous writes are pending");
+        return -1;
+    }
+#endif
+
+    while (device->write.queue.nb > 0) {
+        dispatch_begin(device);
+        int ret = write_queue(device);
+        if (dispatch_end(device)) {
+            return -1; // closed by fp_write
+        }
+        if (ret < 0) {
+            return -1;
+        }
+        if (device->write.queue.nb > 0) {
+            int ready = wait_deadline(device, POLLOUT, deadline);
+            if (ready <= 0) {
+                return ready;
+            }
+        }
+    }
+
+    return 1;
+}
+
+#if defined(__i386__) || defined(__x86_64__)
+#define ASYNC_CPU_RELAX() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define ASYNC_CPU_RELAX() __asm__ __volatile__("yield")
+#else
+#define ASYNC_CPU_RELAX() do { } while (0)
+#endif
+
+/*
+ * The inter-arrival time is averaged over the last 8 packets or so.
+ */
+static void busy_poll_update(struct async_device * device, gtime now) {
+
+    if (device->busy_poll.last != 0) {
+        long long sample = now - device->busy_poll.last;
+        device->busy_poll.interval += (sample - (long long) device->busy_poll.interval) / 8;
+    }
+    device->busy_poll.last = now;
+}
+
+/*
+ * The spin budget (in nanoseconds) covers the expected arrival time of the next packet, plus a margin for jitter.
+ * There is no point spinning if the next packet is not expected within the maximum spin time.
+ */
+static gtime busy_poll_budget(struct async_device * device, gtime now) {
+
+    gtime max = GTIME_USEC(device->busy_poll.spin);
+
+    if (device->busy_poll.interval == 0) {
+        return max; // no history yet
+    }
+
+    gtime elapsed = now - device->busy_poll.last;
+    if (elapsed >= device->busy_poll.interval) {
+        return max; // the packet is late
+    }
+
+    gtime remaining = device->busy_poll.interval - elapsed;
+    if (remaining > max) {
+        return 0;
+    }
+
+    gtime budget = remaining + device->busy_poll.interval / 4;
+    return budget < max ? budget : max;
+}
+
+/*
+ * This function returns 1 while the read should be retried instead of waiting.
+ * The spin end time is set on the first call.
+ */
+static int busy_poll_spin(struct async_device * device, gtime * end, const struct timespec * deadline) {
+
+    if (device->busy_poll.spin == 0) {
+        return 0;
+    }
+
+    gtime now = gtime_gettime();
+
+    if (*end == 0) {
+        gtime limit = deadline->tv_sec * 1000000000ULL + deadline->tv_nsec;
+        *end = now + busy_poll_budget(device, now);
+        if (*end > limit) {
+            *end = limit;
+        }
+    }
+
+    if (now >= *end) {
+        return 0;
+    }
+
+    ASYNC_CPU_RELAX();
+    return 1;
+}
+
+/*
+ * In the poll engine the device is non-blocking and the I/O is attempted before waiting.
+ */
+static int is_optimistic(struct async_device * device __attribute__((unused))) {
+
+#ifdef ASYNC_HAS_IO_URING
+    if (device->uring.enabled) {
+        return 0;
+    }
+#endif
+    return 1;
+}
+
+/*
+ * The timeout (in milliseconds) covers the whole transfer.
+ * Returns the number of read bytes.
+ */
+int async_read_timeout(struct async_device * device, void * buf, unsigned int count, unsigned int timeout) {
+
+  if (device->reader != NULL && device->reader->running) {
+    PRINT_ERROR_OTHER("the device is read by its reader thread");
+    return -1;
+  }
+
+  if (device->replay != NULL) {
+    PRINT_ERROR_OTHER("replay devices have to be registered");
+    return -1;
+  }
+
+  struct timespec deadline;
+  get_deadline(&deadline, timeout);
+
+  int optimistic = is_optimistic(device);
+  int ready = optimistic;
+  unsigned int bread = 0;
+  gtime spin_end = 0;
+
+  while(bread != count)
+  {
+    if(ready)
+    {
+      int res = read(device->fd, buf+bread, count-bread);
+      stats_read(device, res);
+      ready = optimistic;
+      if(res > 0)
+      {
+        if(bread == 0 && device->busy_poll.spin > 0)
+        {
+          busy_poll_update(device, gtime_gettime());
+        }
+        bread += res;
+        continue;
+      }
+      if(res == 0)
+      {
+        break; // end of file
+      }
+      if(errno == EINTR)
+      {
+        continue;
+      }
+      if(errno != EAGAIN && errno != EWOULDBLOCK)
+      {
+        PRINT_ERROR_ERRNO("read");
+        break;
+      }
+      if(busy_poll_spin(device, &spin_end, &deadline))
+      {
+        continue;
+      }
+    }
+    ready = wait_deadline(device, POLLIN, &deadline);
+    if(ready <= 0)
+    {
+      break; // timeout or error
+    }
+  }
+
+  if(bread > 0 && device->record != NULL)
+  {
+    struct iovec iov = { .iov_base = buf, .iov_len = bread };
+    record_io(device, ASYNC_RECORD_READ, &iov, 1, bread);
+  }
+
+  return bread;
+}
+
+/*
+ * The timeout (in milliseconds) covers the whole transfer, including pending asynchronous writes,
+ * which are written first (and reported to fp_write). With the io_uring engine, the write fails
+ * while asynchronous writes are pending.
+ * Returns the number of written bytes.
+ */
+int async_write_timeout_v(struct async_device * device, const struct iovec * iov, int iovcnt, unsigned int timeout) {
+
+  unsigned int count;
+  if(iov_count(iov, iovcnt, &count) < 0)
+  {
+    return -1;
+  }
+
+  if(flush_coalesced(device) < 0)
+  {
+    return -1;
+  }
+
+  struct timespec deadline;
+  get_deadline(&deadline, timeout);
+
+  if(device->write.queue.nb > 0)
+  {
+    int ready = drain_queue(device, &deadline);
+    if(ready <= 0)
+    {
+      return ready; // nothing written
+    }
+  }
+
+  if(device->record != NULL)
+  {
+    record_io(device, ASYNC_RECORD_WRITE, iov, iovcnt, count);
+  }
+
+  if(device->replay != NULL)
+  {
+    return count; // discarded
+  }
+
+  int optimistic = is_optimistic(device);
+  int ready = optimistic;
+  unsigned int bwritten = 0;
+  int index = 0;
+  size_t offset = 0;
+
+  while(bwritten != count)
+  {
+    if(ready)
+    {
+      int res = writev_offset(device->fd, iov, iovcnt, index, offset);
+      stats_write(device, res, count - bwritten);
+      ready = optimistic;
+      if(res > 0)
+      {
+        bwritten += res;
+        iov_advance(iov, iovcnt, res, &index, &offset);
+        continue;
+      }
+      if(res < 0)
+      {
+        if(errno == EINTR)
+        {
+          continue;
+        }
+        if(errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+          PRINT_ERROR_ERRNO("write");
+          break;
+        }
+      }
+    }
+    ready = wait_deadline(device, POLLOUT, &deadline);
+    if(ready <= 0)
+    {
+      break; // timeout or error
+    }
+  }
+
+  if(bwritten == count)
+  {
+    ++device->stats.packets_written;
+  }
+
+  return bwritten;
+}
+
+int async_write_timeout(struct async_device * device, const void * buf, unsigned int count, unsigned int timeout) {
+
+  struct iovec iov = { .iov_base = (void *) buf, .iov_len = count };
+
+  return async_write_timeout_v(device, &iov, 1, timeout);
+}
+
+/*
+ * This function drains the device until EAGAIN or until all slots are filled,
+ * then delivers the packets in a row.
+ * Remaining data (if all slots are filled) is processed on the next wakeup.
+ */
+static int read_batch(struct async_device * device) {
+
+    unsigned int nb = 0;
+
+    while (nb < device->read.slots) {
+        int res = read(device->fd, device->read.buf + nb * device->read.size, device->read.count);
+        stats_read(device, res);
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            PRINT_ERROR_ERRNO("read");
+        }
+        device->read.status[nb++] = res;
+        if (res <= 0) {
+            break; // error or end of file
+        }
+    }
+
+    int ret = 0;
+
+    unsigned int i;
+    for (i = 0; i < nb; ++i) {
+        if (device->read.status[i] > 0) {
+            packet_read(device, device->read.buf + i * device->read.size, device->read.status[i]);
+        }
+        int res = device->callback.fp_read(device->callback.user, (const char *)device->read.buf + i * device->read.size, device->read.status[i]);
+        if (res != 0) {
+            ret = res;
+        }
+        if (device->closed) {
+            break;
+        }
+    }
+
+    return ret;
+}
+
+/*
+ * In ring mode each packet is read into a free slot, which is lent to the user until it gets released.
+ * The device is read until EAGAIN or until no slot is free, in which case reading is suspended.
+ */
+static int read_ring(struct async_device * device) {
+
+    int ret = 0;
+
+    while (device->read.lent < device->read.slots) {
+
+        while (device->read.status[device->read.next] != 0) {
+            device->read.next = (device->read.next + 1) % device->read.slots;
+        }
+
+        char * slot = device->read.buf + device->read.next * device->read.size;
+
+        int res = read(device->fd, slot, device->read.count);
+        stats_read(device, res);
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            PRINT_ERROR_ERRNO("read");
+        }
+
+        if (res > 0) {
+            packet_read(device, slot, res);
+            device->read.status[device->read.next] = res;
+            ++device->read.lent;
+            device->read.next = (device->read.next + 1) % device->read.slots;
+        }
+        else {
+            slot = NULL;
+        }
+
+        int status = device->callback.fp_read(device->callback.user, slot, res);
+        if (status != 0) {
+            ret = status;
+        }
+
+        if (device->closed || res <= 0) {
+            return ret; // closed by the callback, error or end of file
+        }
+    }
+
+    if (poll_update(device) < 0) {
+        ret = -1;
+    }
+
+    return ret;
+}
+
+/*
+ * CRC-32C (Castagnoli), using the ARMv8 CRC instructions when built for them,
+ * the SSE 4.2 instructions when the CPU supports them (checked at runtime),
+ * and slicing-by-8 tables otherwise.
+ */
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+
+static uint32_t crc32c(const unsigned char * data, size_t length) {
+
+    uint32_t crc = 0xFFFFFFFF;
+    for (; length >= 8; data += 8, length -= 8) {
+        uint64_t value;
+        memcpy(&value, data, sizeof(value));
+        crc = __crc32cd(crc, value);
+    }
+    for (; length > 0; ++data, --length) {
+        crc = __crc32cb(crc, *data);
+    }
+    return ~crc;
+}
+#else
+static uint32_t crc32c_table[8][256];
+
+static void crc32c_init(void) {
+
+    unsigned int i, j;
+    for (i = 0; i < 256; ++i) {
+        uint32_t crc = i;
+        for (j = 0; j < 8; ++j) {
+            crc = (crc >> 1) ^ (0x82F63B78 & -(crc & 1));
+        }
+        crc32c_table[0][i] = crc;
+    }
+    for (i = 0; i < 256; ++i) {
+        for (j = 1; j < 8; ++j) {
+            crc32c_table[j][i] = (crc32c_table[j - 1][i] >> 8) ^ crc32c_table[0][crc32c_table[j - 1][i] & 0xFF];
+        }
+    }
+}
+
+static uint32_t crc32c_slicing(const unsigned char * data, size_t length) {
+
+    if (crc32c_table[0][1] == 0) {
+        crc32c_init();
+    }
+
+    uint32_t crc = 0xFFFFFFFF;
+    for (; length >= 8; data += 8, length -= 8) {
+        uint32_t low = crc ^ (data[0] | data[1] << 8 | data[2] << 16 | (uint32_t) data[3] << 24);
+        crc = crc32c_table[7][low & 0xFF] ^ crc32c_table[6][(low >> 8) & 0xFF]
+            ^ crc32c_table[5][(low >> 16) & 0xFF] ^ crc32c_table[4][low >> 24]
+            ^ crc32c_table[3][data[4]] ^ crc32c_table[2][data[5]]
+            ^ crc32c_table[1][data[6]] ^ crc32c_table[0][data[7]];
+    }
+    for (; length > 0; ++data, --length) {
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *data) & 0xFF];
+    }
+    return ~crc;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+
+static __attribute__((target("sse4.2"))) uint32_t crc32c_sse42(const unsigned char * data, size_t length) {
+
+#ifdef __x86_64__
+    uint64_t crc = 0xFFFFFFFF;
+    for (; length >= 8; data += 8, length -= 8) {
+        uint64_t value;
+        memcpy(&value, data, sizeof(value));
+        crc = _mm_crc32_u64(crc, value);
+    }
+#else
+    uint32_t crc = 0xFFFFFFFF;
+    for (; length >= 4; data += 4, length -= 4) {
+        uint32_t value;
+        memcpy(&value, data, sizeof(value));
+        crc = _mm_crc32_u32(crc, value);
+    }
+#endif
+    for (; length > 0; ++data, --length) {
+        crc = _mm_crc32_u8(crc, *data);
+    }
+    return ~crc;
+}
+#endif
+
+static uint32_t crc32c(const unsigned char * data, size_t length) {
+
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        return crc32c_sse42(data, length);
+    }
+#endif
+    return crc32c_slicing(data, length);
+}
+#endif
+
+static int check_frame(struct async_device * device, const unsigned char * frame, unsigned int length) {
+
+    switch (device->framing.config.checksum) {
+    case E_ASYNC_CHECKSUM_NONE:
+        return 0;
+    case E_ASYNC_CHECKSUM_CRC32C:
+        if (length >= 4) {
+            const unsigned char * p = frame + length - 4;
+            uint32_t expected = p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+            if (crc32c(frame, length - 4) == expected) {
+                return 0;
+            }
+        }
+        break;
+    }
+
+    if (GLOG_LEVEL(GLOG_NAME,DEBUG)) {
+        fprintf(stderr, "%s:%d %s: bad checksum for device (%s)\n", __FILE__, __LINE__, __func__, device->path);
+    }
+    return -1;
+}
+
+/*
+ * This function delivers the complete frames at the beginning of the receive buffer,
+ * and moves the remaining bytes to the beginning.
+ */
+static int deliver_frames(struct async_device * device) {
+
+    const ASYNC_FRAMING * config = &device->framing.config;
+    const unsigned char * data = (const unsigned char *) device->framing.buf;
+    unsigned int start = 0;
+    int ret = 0;
+
+    while (start < device->framing.count) {
+
+        const unsigned char * frame = data + start;
+        unsigned int available = device->framing.count - start;
+        unsigned int length; // delivered bytes
+        unsigned int size; // consumed bytes
+        unsigned int skip; // consumed bytes if the frame is invalid
+
+        if (config->type == E_ASYNC_FRAMING_FIXED) {
+            if (available < config->size) {
+                break;
+            }
+            length = size = skip = config->size;
+        }
+        else if (config->type == E_ASYNC_FRAMING_LENGTH) {
+            unsigned int header = config->length.offset + config->length.width;
+            if (available < header) {
+                break;
+            }
+            unsigned int value = 0;
+            unsigned int i;
+            for (i = 0; i < config->length.width; ++i) {
+                unsigned int index = config->length.big_endian ? i : config->length.width - 1 - i;
+                value = (value << 8) | frame[config->length.offset + index];
+            }
+            long long total = (long long) value + config->length.adjust;
+            if (total < header || total > config->max_size) {
+                ++device->stats.frame_errors;
+                ++start; // resynchronize
+                continue;
+            }
+            if (available < total) {
+                break;
+            }
+            length = size = total;
+            skip = 1;
+        }
+        else {
+            const unsigned char * end = memchr(frame, config->delimiter, available);
+            if (end == NULL) {
+                if (available >= config->max_size) {
+                    ++device->stats.frame_errors;
+                    start = device->framing.count; // no delimiter, drop the data
+                }
+                break;
+            }
+            length = end - frame;
+            size = skip = length + 1;
+            if (length > config->max_size) {
+                ++device->stats.frame_errors;
+                start += size;
+                continue;
+            }
+        }
+
+        if (check_frame(device, frame, length) < 0) {
+            ++device->stats.frame_errors;
+            start += skip;
+            continue;
+        }
+
+        packet_read(device, frame, length);
+
+        int status = device->callback.fp_read(device->callback.user, (const char *) frame, length);
+        if (status != 0) {
+            ret = status;
+        }
+
+        if (device->closed) {
+            return ret;
+        }
+
+        start += size;
+    }
+
+    device->framing.count -= start;
+    memmove(device->framing.buf, device->framing.buf + start, device->framing.count);
+
+    return ret;
+}
+
+/*
+ * In framing mode the data is accumulated in the receive buffer, and fp_read is called for each complete frame.
+ */
+static int read_framed(struct async_device * device) {
+
+    int res = read(device->fd, device->framing.buf + device->framing.count, device->framing.size - device->framing.count);
+    stats_read(device, res);
+    if (res <= 0) {
+        if (res < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                return 0;
+            }
+            PRINT_ERROR_ERRNO("read");
+        }
+        return device->callback.fp_read(device->callback.user, NULL, res);
+    }
+
+    device->framing.count += res;
+
+    return deliver_frames(device);
+}
+
+/*
+ * This function returns the next recorded read, or -1 at the end of the file.
+ * A truncated record ends the file.
+ */
+static int replay_next(s_replay * replay, s_record_header * header, const char ** data) {
+
+    while (replay->offset + sizeof(*header) <= replay->size) {
+        memcpy(header, replay->data + replay->offset, sizeof(*header));
+        if (header->size > replay->size - replay->offset - sizeof(*header)) {
+            break;
+        }
+        if (header->direction == ASYNC_RECORD_READ) {
+            *data = replay->data + replay->offset + sizeof(*header);
+            return 0;
+        }
+        replay->offset += sizeof(*header) + header->size; // skip writes
+    }
+
+    replay->offset = replay->size;
+    return -1;
+}
+
+static gtime replay_due(s_replay * replay, const s_record_header * header) {
+
+    if (replay->speed <= 0 || header->time <= replay->origin) {
+        return replay->start;
+    }
+
+    return replay->start + (gtime) ((header->time - replay->origin) / replay->speed);
+}
+
+/*
+ * Arm the timer for the next recorded read, or for the end of the file.
+ */
+static int replay_arm(struct async_device * device) {
+
+    s_replay * replay = device->replay;
+    s_record_header header;
+    const char * data;
+
+    gtime due = 1;
+    if (replay_next(replay, &header, &data) == 0) {
+        due = replay_due(replay, &header);
+    }
+
+    struct itimerspec its = {
+        .it_interval = { 0, 0 },
+        .it_value = { .tv_sec = due / 1000000000ULL, .tv_nsec = due % 1000000000ULL }
+    };
+    if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0) {
+        its.it_value.tv_nsec = 1; // a zero value disarms the timer
+    }
+
+    if (timerfd_settime(device->fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+        PRINT_ERROR_ERRNO("timerfd_settime");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Deliver the recorded reads that are due, pointing into the mapped file.
+ * At the end of the file fp_read receives a NULL buffer and a 0 status, and the timer is disarmed.
+ */
+static int replay_read(struct async_device * device) {
+
+    s_replay * replay = device->replay;
+
+    uint64_t expirations;
+    if (read(device->fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+        PRINT_ERROR_ERRNO("read");
+    }
+
+    gtime now = gtime_gettime();
+    s_record_header header;
+    const char * data;
+    unsigned int burst;
+
+    for (burst = 0; burst < ASYNC_REPLAY_BURST; ++burst) {
+        if (replay_next(replay, &header, &data) < 0) {
+            struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+            timerfd_settime(device->fd, 0, &its, NULL);
+            return device->callback.fp_read(device->callback.user, NULL, 0);
+        }
+        if (replay_due(replay, &header) > now) {
+            break;
+        }
+        replay->offset += sizeof(header) + header.size;
+        packet_read(device, data, header.size);
+        int ret = device->callback.fp_read(device->callback.user, data, header.size);
+        if (device->closed) {
+            return ret;
+        }
+        if (ret != 0) {
+            replay_arm(device);
+            return ret;
+        }
+    }
+
+    return replay_arm(device);
+}
+
+/*
+ * In busy poll mode, the device is read again after each packet, for the spin budget,
+ * and the time spent in the callback is bounded by the maximum spin time.
+ */
+static int read_busy_poll(struct async_device * device) {
+
+    gtime now = gtime_gettime();
+    gtime limit = now + GTIME_USEC(device->busy_poll.spin);
+    gtime end = now; // the device is readable, there is no need to spin for the first read
+
+    int ret = 0;
+
+    for (;;) {
+        int res = read(device->fd, device->read.buf, device->read.count);
+        stats_read(device, res);
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (gtime_gettime() < end) {
+                    ASYNC_CPU_RELAX();
+                    continue;
+                }
+                break;
+            }
+            PRINT_ERROR_ERRNO("read");
+        }
+        else if (res > 0) {
+            now = gtime_gettime();
+            packet_read(device, device->read.buf, res);
+            busy_poll_update(device, now);
+            end = now + busy_poll_budget(device, now);
+            if (end > limit) {
+                end = limit;
+            }
+        }
+        ret = device->callback.fp_read(device->callback.user, (const char *)device->read.buf, res);
+        if (ret != 0 || res <= 0 || device->closed) {
+            break;
+        }
+    }
+
+    return ret;
+}
+
+/*
+ * The read mode summarizes the read settings in the first cache line, as it is checked on each read event.
+ * This function has to be called each time a read setting changes.
+ */
+static void read_mode_update(struct async_device * device) {
+
+    if (device->replay != NULL) {
+        device->read.mode = ASYNC_READ_MODE_REPLAY;
+    }
+    else if (device->read.framed) {
+        device->read.mode = ASYNC_READ_MODE_FRAMED;
+    }
+    else if (device->read.ring) {
+        device->read.mode = ASYNC_READ_MODE_RING;
+    }
+    else if (device->read.slots > 1) {
+        device->read.mode = ASYNC_READ_MODE_BATCH;
+    }
+    else if (device->busy_poll.spin > 0) {
+        device->read.mode = ASYNC_READ_MODE_BUSY_POLL;
+    }
+    else {
+        device->read.mode = ASYNC_READ_MODE_SINGLE;
+    }
+}
+
+/*
+ * The io_uring engine only supports the default read mode.
+ */
+static int check_uring_read_mode(struct async_device * device __attribute__((unused))) {
+
+#ifdef ASYNC_HAS_IO_URING
+    if (device->uring.requested) {
+        PRINT_ERROR_OTHER("the io_uring engine only supports single packet reads");
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+/*
+ * This function reads the device according to its read mode, and delivers the data to fp_read.
+ */
+static int read_device(struct async_device * device) {
+
+    switch (device->read.mode) {
+    case ASYNC_READ_MODE_REPLAY:
+        return replay_read(device);
+    case ASYNC_READ_MODE_FRAMED:
+        return read_framed(device);
+    case ASYNC_READ_MODE_RING:
+        return read_ring(device);
+    case ASYNC_READ_MODE_BATCH:
+        return read_batch(device);
+    case ASYNC_READ_MODE_BUSY_POLL:
+        return read_busy_poll(device);
+    }
+
+    int ret = read(device->fd, device->read.buf, device->read.count);
+
+    stats_read(device, ret);
+
+    if(ret < 0) {
+        PRINT_ERROR_ERRNO("read");
+    }
+    else if(ret > 0) {
+        packet_read(device, device->read.buf, ret);
+    }
+
+    return device->callback.fp_read(device->callback.user, (const char *)device->read.buf, ret);
+}
+
+/*
+ * This function is called on data reception.
+ */
+static int read_callback(void * user) {
+
+    struct async_device * device = (struct async_device *) user;
+
+    dispatch_begin(device);
+
+    int ret = read_device(device);
+
+    dispatch_end(device);
+
+    return ret;
+}
+
+/*
+ * This function writes the queued data until EAGAIN, and reports each completed write to fp_write.
+ */
+static int write_queue(struct async_device * device) {
+
+    int ret = 0;
+
+    if (device->write.coalesce.window == 0 && flush_coalesced(device) < 0) {
+        ret = -1;
+    }
+
+    while (device->write.queue.nb > 0) {
+
+        int status;
+
+        unsigned int offset = device->write.queue.data[0].offset;
+        unsigned int count = device->write.queue.data[0].count;
+
+        int res = write(device->fd, device->write.queue.data[0].buf + offset, count - offset);
+        stats_write(device, res, count - offset);
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            PRINT_ERROR_ERRNO("write");
+            status = -1;
+            ret = -1;
+        }
+        else if (res == 0 && offset < count) {
+            PRINT_ERROR_OTHER("write did not make progress");
+            status = -1;
+            ret = -1;
+        }
+        else {
+            device->write.queue.data[0].offset += res;
+            if (device->write.queue.data[0].offset < count) {
+                continue;
+            }
+            status = count;
+            ++device->stats.packets_written;
+        }
+
+        dequeue_write(device);
+
+        if (device->callback.fp_write != NULL) {
+            device->callback.fp_write(device->callback.user, status);
+            if (device->closed) {
+                return ret;
+            }
+        }
+    }
+
+    if (poll_update(device) < 0) {
+        ret = -1;
+    }
+
+    return ret;
+}
+
+/*
+ * This function is called when the device is writable and the write queue is not empty.
+ */
+static int write_callback(void * user) {
+
+    struct async_device * device = (struct async_device *) user;
+
+    dispatch_begin(device);
+
+    int ret = write_queue(device);
+
+    dispatch_end(device);
+
+    return ret;
+}
+
+/*
+ * This function is called on failure.
+ */
+static int close_callback(void * user) {
+
+    struct async_device * device = (struct async_device *) user;
+
+    return device->callback.fp_close(device->callback.user);
+}
+
+static int alloc_read_slots(struct async_device * device, unsigned int size, unsigned int slots) {
+
+    if (device->reader != NULL && device->reader->running) {
+        PRINT_ERROR_OTHER("the device is read by its reader thread");
+        return -1;
+    }
+
+    if (device->read.lent > 0) {
+        PRINT_ERROR_OTHER("read buffers are still lent");
+        return -1;
+    }
+
+#ifdef ASYNC_HAS_IO_URING
+    if (device->uring.reading) {
+        PRINT_ERROR_OTHER("a read is pending");
+        return -1;
+    }
+#endif
+
+    if (slots == 0) {
+        slots = 1;
+    }
+
+    if (device->pooled) {
+        if (size > pool.read_size || slots > pool.slots) {
+            PRINT_ERROR_OTHER("read buffer exceeds the pool reservation");
+            return -1;
+        }
+        device->read.size = pool.read_size;
+        device->read.slots = slots;
+        device->read.next = 0;
+        memset(device->read.status, 0x00, slots * sizeof(*device->read.status));
+        return 0;
+    }
+
+    if (size < device->read.size) {
+        size = device->read.size;
+    }
+
+    if (size > 0 && (size > device->read.size || slots > device->read.slots)) {
+        if (size > UINT_MAX / slots) {
+            PRINT_ERROR_OTHER("read buffer is too large");
+            return -1;
+        }
+        void * ptr = realloc(device->read.buf, size * slots);
+        if(ptr == NULL) {
+            PRINT_ERROR_ALLOC_FAILED("realloc");
+            return -1;
+        }
+        device->read.buf = ptr;
+        device->read.size = size;
+    }
+
+    if (slots > device->read.slots) {
+        void * ptr = realloc(device->read.status, slots * sizeof(*device->read.status));
+        if(ptr == NULL) {
+            PRINT_ERROR_ALLOC_FAILED("realloc");
+            return -1;
+        }
+        device->read.status = ptr;
+    }
+
+    device->read.slots = slots;
+    device->read.next = 0;
+    memset(device->read.status, 0x00, slots * sizeof(*device->read.status));
+
+    return 0;
+}
+
+int async_set_read_size(struct async_device * device, unsigned int size) {
+
+    if (alloc_read_slots(device, size, device->read.slots) < 0) {
+        return -1;
+    }
+
+    device->read.count = size;
+
+    return 0;
+}
+
+/*
+ * Enable batched reads: on each wakeup the device is read until EAGAIN, storing up to 'slots'
+ * packets of the read size, and each packet is then delivered to fp_read.
+ * A value of 1 restores the default behavior (a single read per wakeup).
+ */
+int async_set_read_batch(struct async_device * device, unsigned int slots) {
+
+    if (slots > 1 && check_uring_read_mode(device) < 0) {
+        return -1;
+    }
+
+    if (alloc_read_slots(device, device->read.count, slots) < 0) {
+        return -1;
+    }
+
+    device->read.ring = 0;
+    read_mode_update(device);
+
+    return 0;
+}
+
+/*
+ * Enable the buffer lending mode: packets are read into a ring of 'slots' buffers of the read size,
+ * and the buffer passed to fp_read remains valid until it is given back with async_release_read_buffer.
+ * When all buffers are lent, reading is suspended until a buffer is released.
+ * On error or end of file fp_read receives a NULL buffer, which must not be released.
+ */
+int async_set_read_ring(struct async_device * device, unsigned int slots) {
+
+    if (slots == 0) {
+        PRINT_ERROR_OTHER("the ring needs at least one slot");
+        return -1;
+    }
+
+    if (check_uring_read_mode(device) < 0) {
+        return -1;
+    }
+
+    if (alloc_read_slots(device, device->read.count, slots) < 0) {
+        return -1;
+    }
+
+    device->read.ring = 1;
+    read_mode_update(device);
+
+    return 0;
+}
+
+int async_release_read_buffer(struct async_device * device, const void * buf) {
+
+    if (!device->read.ring || device->read.size == 0 || (const char *) buf < device->read.buf) {
+        PRINT_ERROR_OTHER("not a lent buffer");
+        return -1;
+    }
+
+    size_t offset = (const char *) buf - device->read.buf;
+    unsigned int index = offset / device->read.size;
+    if (index >= device->read.slots || offset % device->read.size || device->read.status[index] == 0) {
+        PRINT_ERROR_OTHER("not a lent buffer");
+        return -1;
+    }
+
+    device->read.status[index] = 0;
+    --device->read.lent;
+
+    return poll_update(device);
+}
+
+/*
+ * Readability is polled if there is a read callback, unless all ring buffers are lent,
+ * or unless the device is read by its reader thread.
+ * Writability is only polled while the write queue is not empty.
+ */
+static unsigned int poll_events(struct async_device * device) {
+
+    unsigned int events = 0;
+    if (device->callback.fp_read != NULL && (!device->read.ring || device->read.lent < device->read.slots)
+            && (device->reader == NULL || !device->reader->running)) {
+        events |= ASYNC_POLL_READ;
+    }
+    if (device->write.queue.nb > 0 || (device->write.coalesce.count > 0 && device->write.coalesce.window == 0)) {
+        events |= ASYNC_POLL_WRITE;
+    }
+    return events;
+}
+
+/*
+ * This function registers the device to the event sources.
+ */
+static int poll_register(struct async_device * device) {
+
+    unsigned int events = poll_events(device);
+
+    device->polled = events;
+
+    if (events == 0) {
+        return 0;
+    }
+
+    GPOLL_CALLBACKS gpoll_callbacks = {
+            .fp_read = (events & ASYNC_POLL_READ) ? read_callback : NULL,
+            .fp_write = (events & ASYNC_POLL_WRITE) ? write_callback : NULL,
+            .fp_close = close_callback,
+    };
+    return device->callback.fp_register(device->fd, device, &gpoll_callbacks);
+}
+
+/*
+ * This function updates the registration of the device if the polled events changed.
+ */
+static int poll_update(struct async_device * device) {
+
+#ifdef ASYNC_HAS_IO_URING
+    if (device->uring.enabled) {
+        return 0;
+    }
+#endif
+
+    if (device->callback.fp_register == NULL || device->polled == poll_events(device)) {
+        return 0;
+    }
+
+    if (device->polled != 0 && device->callback.fp_remove != NULL) {
+        device->callback.fp_remove(device->fd);
+    }
+
+    return poll_register(device);
+}
+
+/*
+ * The reader thread waits for the device to be readable, and reads it until EAGAIN.
+ * If the ring is full the packet is dropped. The thread exits on read error or end of file,
+ * once the status has been pushed to the ring.
+ */
+static void * reader_thread(void * arg) {
+
+    struct async_device * device = (struct async_device *) arg;
+    struct async_reader * reader = device->reader;
+
+    struct pollfd fds[2] = {
+            { .fd = device->fd, .events = POLLIN },
+            { .fd = reader->stop, .events = POLLIN },
+    };
+
+    char * scratch = reader->buf + ASYNC_READER_RING_SIZE * device->read.size; // for dropped packets
+
+    for (;;) {
+        int res = poll(fds, 2, -1);
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            PRINT_ERROR_ERRNO("poll");
+            return NULL;
+        }
+        if (fds[1].revents) {
+            return NULL;
+        }
+        for (;;) {
+            s_reader_packet * packet = gring_reader_reserve(&reader->ring);
+            char * slot = scratch;
+            if (packet != NULL) {
+                slot = reader->buf + (packet - reader->ring.data) * device->read.size;
+            }
+            res = read(device->fd, slot, device->read.count);
+            if (res < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    break;
+                }
+            }
+            if (packet == NULL) {
+                if (res > 0) {
+                    __atomic_fetch_add(&reader->dropped, 1, __ATOMIC_RELAXED);
+                    continue;
+                }
+                // make room for the final status
+                int error = errno;
+                while ((packet = gring_reader_reserve(&reader->ring)) == NULL) {
+                    if (poll(fds + 1, 1, 1) > 0) {
+                        return NULL;
+                    }
+                }
+                errno = error;
+            }
+            packet->status = res;
+            packet->error = res < 0 ? errno : 0;
+            gring_reader_publish(&reader->ring, 1);
+            // wake the poll loop if it may have seen an empty ring
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (gring_reader_count(&reader->ring) == 1) {
+                uint64_t value = 1;
+                if (write(reader->event, &value, sizeof(value)) < 0) {
+                    PRINT_ERROR_ERRNO("write");
+                }
+            }
+            if (res <= 0) {
+                return NULL; // error or end of file
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * This function is called from the poll loop when the reader thread signals new packets.
+ */
+static int reader_callback(void * user) {
+
+    struct async_device * device = (struct async_device *) user;
+    struct async_reader * reader = device->reader;
+
+    uint64_t value;
+    if (read(reader->event, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+        PRINT_ERROR_ERRNO("read");
+    }
+
+    int ret = 0;
+
+    dispatch_begin(device);
+
+    s_reader_packet * packet;
+    while ((packet = gring_reader_front(&reader->ring)) != NULL) {
+        unsigned int index = packet - reader->ring.data;
+        int status = packet->status;
+        if (status < 0) {
+            errno = packet->error;
+            PRINT_ERROR_ERRNO("read");
+        }
+        stats_read(device, status);
+        if (status > 0) {
+            packet_read(device, reader->buf + index * device->read.size, status);
+        }
+        int res = device->callback.fp_read(device->callback.user, reader->buf + index * device->read.size, status);
+        if (res != 0) {
+            ret = res;
+        }
+        if (device->closed || status <= 0) {
+            break; // closed by the callback, or the reader thread exited
+        }
+        gring_reader_consume(&reader->ring, 1);
+        // pairs with the fence of the reader thread before it checks if the ring was empty
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+
+    dispatch_end(device);
+
+    return ret;
+}
+
+static int reader_start(struct async_device * device) {
+
+    struct async_reader * reader = device->reader;
+
+    if (device->read.ring || device->read.framed || device->read.slots > 1) {
+        PRINT_ERROR_OTHER("the reader thread only supports single packet reads");
+        return -1;
+    }
+#ifdef ASYNC_HAS_IO_URING
+    if (device->uring.requested) {
+        PRINT_ERROR_OTHER("the reader thread requires the poll engine");
+        return -1;
+    }
+#endif
+
+    if (device->read.size > UINT_MAX / (ASYNC_READER_RING_SIZE + 1)) {
+        PRINT_ERROR_OTHER("read buffer is too large");
+        return -1;
+    }
+
+    free(reader->buf);
+    reader->buf = malloc((ASYNC_READER_RING_SIZE + 1) * device->read.size + 1);
+    if (reader->buf == NULL) {
+        PRINT_ERROR_ALLOC_FAILED("malloc");
+        return -1;
+    }
+    gring_reader_init(&reader->ring);
+
+    GPOLL_CALLBACKS gpoll_callbacks = {
+            .fp_read = reader_callback,
+            .fp_write = NULL,
+            .fp_close = close_callback,
+    };
+    if (device->callback.fp_register(reader->event, device, &gpoll_callbacks) < 0) {
+        return -1;
+    }
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (reader->cpu >= 0) {
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        CPU_SET(reader->cpu, &cpuset);
+        pthread_attr_setaffinity_np(&attr, sizeof(cpuset), &cpuset);
+    }
+    int res = pthread_create(&reader->thread, &attr, reader_thread, device);
+    pthread_attr_destroy(&attr);
+    if (res != 0) {
+        errno = res;
+        PRINT_ERROR_ERRNO("pthread_create");
+        device->callback.fp_remove(reader->event);
+        return -1;
+    }
+
+    reader->running = 1;
+
+    return 0;
+}
+
+static void reader_stop(struct async_device * device) {
+
+    struct async_reader * reader = device->reader;
+
+    if (reader->running) {
+        uint64_t value = 1;
+        if (write(reader->stop, &value, sizeof(value)) < 0) {
+            PRINT_ERROR_ERRNO("write");
+        }
+        pthread_join(reader->thread, NULL);
+        reader->running = 0;
+        if (device->callback.fp_remove != NULL) {
+            device->callback.fp_remove(reader->event);
+        }
+    }
+
+    close(reader->event);
+    close(reader->stop);
+    free(reader->buf);
+    free(reader);
+    device->reader = NULL;
+}
+
+/*
+ * Read the device from a dedicated thread, pinned to 'cpu' unless it is negative.
+ * The thread starts when the device gets registered, and packets are still delivered to fp_read
+ * from the poll loop, which is woken through an eventfd. Writes are not affected.
+ * This has to be called before async_register, and is not compatible with batched reads,
+ * the buffer lending mode, the framing mode, and the io_uring engine.
+ * Read statistics are updated when packets are delivered.
+ */
+int async_set_reader_thread(struct async_device * device, int cpu) {
+
+    if (device->callback.fp_register != NULL) {
+        PRINT_ERROR_OTHER("the device is already registered");
+        return -1;
+    }
+
+    if (device->reader != NULL) {
+        device->reader->cpu = cpu;
+        return 0;
+    }
+
+    if (cpu >= CPU_SETSIZE) {
+        PRINT_ERROR_OTHER("invalid cpu");
+        return -1;
+    }
+
+    struct async_reader * reader = aligned_alloc(ASYNC_CACHE_LINE_SIZE, sizeof(*reader));
+    if (reader == NULL) {
+        PRINT_ERROR_ALLOC_FAILED("aligned_alloc");
+        return -1;
+    }
+    memset(reader, 0x00, sizeof(*reader));
+    reader->cpu = cpu;
+
+    reader->event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (reader->event < 0) {
+        PRINT_ERROR_ERRNO("eventfd");
+        free(reader);
+        return -1;
+    }
+
+    reader->stop = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (reader->stop < 0) {
+        PRINT_ERROR_ERRNO("eventfd");
+        close(reader->event);
+        free(reader);
+        return -1;
+    }
+
+    device->reader = reader;
+
+    return 0;
+}
+
+int async_register(struct async_device * device, void * user, const ASYNC_CALLBACKS * callbacks) {
+
+    if (callbacks->fp_remove == NULL) {
+        PRINT_ERROR_OTHER("fp_remove is NULL");
+    }
+
+    if (callbacks->fp_register == NULL) {
+        PRINT_ERROR_OTHER("fp_register is NULL");
+    }
+
+    device->callback.user = user;
+    device->callback.fp_read = callbacks->fp_read;
+    device->callback.fp_write = callbacks->fp_write;
+    device->callback.fp_close = callbacks->fp_close;
+    device->callback.fp_register = callbacks->fp_register;
+    device->callback.fp_remove = callbacks->fp_remove;
+
+    if (device->write.coalesce.timer >= 0 && register_coalesce_timer(device) < 0) {
+        return -1;
+    }
+
+    if (device->replay != NULL) {
+        device->replay->start = gtime_gettime();
+        if (replay_arm(device) < 0) {
+            return -1;
+        }
+        return poll_register(device);
+    }
+
+    if (device->reader != NULL && device->callback.fp_read != NULL && reader_start(device) < 0) {
+        return -1;
+    }
+
+#ifdef ASYNC_HAS_IO_URING
+    if (device->uring.requested) {
+        if (uring_register(device) == 0) {
+            return 0;
+        }
+        if (device->uring.enabled) {
+            return -1;
+        }
+        if (GLOG_LEVEL(GLOG_NAME,INFO)) {
+            fprintf(stderr, "%s:%d %s: falling back to the poll engine for device (%s)\n", __FILE__, __LINE__, __func__, device->path);
+        }
+    }
+#endif
+
+    return poll_register(device);
+}
+
+/*
+ * Select the engine used once the device gets registered.
+ * If the io_uring engine can't be used at registration time, the poll engine is used instead.
+ * The io_uring engine only supports the default read mode: batched reads, the buffer lending mode,
+ * the framing mode, busy polling and replay devices are rejected, before or after selecting it.
+ *
+ * Returns -1 if the engine is not supported by this build, or by the read mode of the device.
+ */
+int async_set_engine(struct async_device * device, e_async_engine engine) {
+
+    switch (engine) {
+    case E_ASYNC_ENGINE_POLL:
+#ifdef ASYNC_HAS_IO_URING
+        device->uring.requested = 0;
+#endif
+        return 0;
+    case E_ASYNC_ENGINE_IO_URING:
+#ifdef ASYNC_HAS_IO_URING
+        if (device->read.mode != ASYNC_READ_MODE_SINGLE) {
+            PRINT_ERROR_OTHER("the io_uring engine only supports single packet reads");
+            return -1;
+        }
+        device->uring.requested = 1;
+        return 0;
+#else
+        PRINT_ERROR_OTHER("io_uring is not supported");
+        return -1;
+#endif
+    }
+
+    return -1;
+}
+
+/*
+ * Get the engine in use, which may differ from the selected one if io_uring was not available at registration time.
+ */
+e_async_engine async_get_engine(struct async_device * device __attribute__((unused))) {
+
+#ifdef ASYNC_HAS_IO_URING
+    if (device->uring.enabled) {
+        return E_ASYNC_ENGINE_IO_URING;
+    }
+#endif
+    return E_ASYNC_ENGINE_POLL;
+}
+
+/*
+ * This function writes the vector, or queues what can't be written immediately.
+ */
+static int write_vector(struct async_device * device, const struct iovec * iov, int iovcnt, unsigned int count) {
+
+    if (device->record != NULL) {
+        record_io(device, ASYNC_RECORD_WRITE, iov, iovcnt, count);
+    }
+
+    if (device->replay != NULL) {
+        return count; // discarded
+    }
+
+#ifdef ASYNC_HAS_IO_URING
+    if (device->uring.enabled) {
+        if (queue_write(device, iov, iovcnt, count, 0) < 0) {
+            return -1;
+        }
+        if (!device->uring.writing && uring_post_write(device) < 0) {
+            dequeue_write(device);
+            return -1;
+        }
+        return 0;
+    }
+#endif
+
+    if (device->write.queue.nb > 0) {
+        // preserve ordering
+        if (queue_write(device, iov, iovcnt, count, 0) < 0) {
+            return -1;
+        }
+        return 0;
+    }
+
+    int ret = writev_offset(device->fd, iov, iovcnt, 0, 0);
+    stats_write(device, ret, count);
+    if (ret == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            PRINT_ERROR_ERRNO("write");
+            return -1;
+        }
+        ret = 0;
+    }
+
+    if((unsigned int) ret == count) {
+        ++device->stats.packets_written;
+        return ret;
+    }
+
+    if (device->callback.fp_register == NULL) {
+        if (GLOG_LEVEL(GLOG_NAME,ERROR)) {
+            fprintf(stderr, "%s:%d write: only %u written (requested %u)\n", __FILE__, __LINE__, ret, count);
+        }
+        return ret;
+    }
+
+    if (queue_write(device, iov, iovcnt, count, ret) < 0) {
+        return -1;
+    }
+
+    if (poll_update(device) < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * This function writes the coalesced data through the regular write path.
+ */
+static int flush_coalesced(struct async_device * device) {
+
+    unsigned int count = device->write.coalesce.count;
+    if (count == 0) {
+        return 0;
+    }
+
+    device->write.coalesce.count = 0;
+
+    if (device->write.coalesce.window > 0) {
+        struct itimerspec its = { .it_value = { 0, 0 } };
+        if (timerfd_settime(device->write.coalesce.timer, 0, &its, NULL) < 0) {
+            PRINT_ERROR_ERRNO("timerfd_settime");
+        }
+    }
+
+    struct iovec iov = { .iov_base = device->write.coalesce.buf, .iov_len = count };
+
+    return write_vector(device, &iov, 1, count) < 0 ? -1 : 0;
+}
+
+static int coalesce_write(struct async_device * device, const struct iovec * iov, int iovcnt, unsigned int count) {
+
+    if (device->write.coalesce.count + count > device->write.coalesce.size) {
+        if (flush_coalesced(device) < 0) {
+            return -1;
+        }
+        if (count > device->write.coalesce.size) {
+            return write_vector(device, iov, iovcnt, count);
+        }
+    }
+
+    int first = (device->write.coalesce.count == 0);
+
+    int i;
+    for (i = 0; i < iovcnt; ++i) {
+        memcpy(device->write.coalesce.buf + device->write.coalesce.count, iov[i].iov_base, iov[i].iov_len);
+        device->write.coalesce.count += iov[i].iov_len;
+    }
+
+    if (first) {
+        if (device->write.coalesce.window > 0) {
+            struct itimerspec its = {
+                .it_value = {
+                    .tv_sec = device->write.coalesce.window / 1000000,
+                    .tv_nsec = (device->write.coalesce.window % 1000000) * 1000
+                }
+            };
+            if (timerfd_settime(device->write.coalesce.timer, 0, &its, NULL) < 0) {
+                PRINT_ERROR_ERRNO("timerfd_settime");
+                return -1;
+            }
+        }
+        else if (poll_update(device) < 0) {
+            return -1;
+        }
+    }
+
+    return count;
+}
+
+/*
+ * If the device is registered, data that can't be written immediately is queued,
+ * and fp_write is called when each queued buffer is completely written.
+ * A partially written vector is queued, and writing resumes at the first unwritten byte.
+ *
+ * If write coalescing is enabled, the data is appended to the coalescing buffer and its size is returned.
+ *
+ * Returns the number of written bytes, 0 if the data was queued, or -1 on failure.
+ */
+int async_writev(struct async_device * device, const struct iovec * iov, int iovcnt) {
+
+    unsigned int count;
+    if (iov_count(iov, iovcnt, &count) < 0) {
+        return -1;
+    }
+
+    if (device->write.coalesce.size > 0 && device->callback.fp_register != NULL
+#ifdef ASYNC_HAS_IO_URING
+            && !device->uring.enabled
+#endif
+            ) {
+        return coalesce_write(device, iov, iovcnt, count);
+    }
+
+    return write_vector(device, iov, iovcnt, count);
+}
+
+/*
+ * This function is called when the coalescing window expires.
+ */
+static int coalesce_timer_callback(void * user) {
+
+    struct async_device * device = (struct async_device *) user;
+
+    uint64_t expirations;
+    if (read(device->write.coalesce.timer, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+        PRINT_ERROR_ERRNO("read");
+    }
+
+    return flush_coalesced(device);
+}
+
+static int register_coalesce_timer(struct async_device * device) {
+
+    GPOLL_CALLBACKS gpoll_callbacks = {
+            .fp_read = coalesce_timer_callback,
+            .fp_write = NULL,
+            .fp_close = close_callback,
+    };
+    return device->callback.fp_register(device->write.coalesce.timer, device, &gpoll_callbacks);
+}
+
+/*
+ * Enable write coalescing: data written with async_write or async_writev is merged into a buffer of 'size' bytes,
+ * which is written when it is full, when 'window' microseconds elapsed since the first merged write,
+ * or on the next poll iteration if 'window' is 0.
+ * This only applies to registered devices using the poll engine.
+ * A size of 0 disables coalescing.
+ */
+int async_set_write_coalescing(struct async_device * device, unsigned int window, unsigned int size) {
+
+    if (flush_coalesced(device) < 0) {
+        return -1;
+    }
+
+    if (size != device->write.coalesce.size) {
+        void * ptr = NULL;
+        if (size > 0) {
+            ptr = malloc(size);
+            if (ptr == NULL) {
+                PRINT_ERROR_ALLOC_FAILED("malloc");
+                return -1;
+            }
+        }
+        free(device->write.coalesce.buf);
+        device->write.coalesce.buf = ptr;
+        device->write.coalesce.size = size;
+    }
+
+    device->write.coalesce.window = window;
+
+    if (size > 0 && window > 0) {
+        if (device->write.coalesce.timer < 0) {
+            device->write.coalesce.timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+            if (device->write.coalesce.timer < 0) {
+                PRINT_ERROR_ERRNO("timerfd_create");
+                return -1;
+            }
+            if (device->callback.fp_register != NULL && register_coalesce_timer(device) < 0) {
+                close(device->write.coalesce.timer);
+                device->write.coalesce.timer = -1;
+                return -1;
+            }
+        }
+    }
+    else if (device->write.coalesce.timer >= 0) {
+        if (device->callback.fp_remove != NULL) {
+            device->callback.fp_remove(device->write.coalesce.timer);
+        }
+        close(device->write.coalesce.timer);
+        device->write.coalesce.timer = -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Enable the framing mode: the received data is split into frames, and fp_read is called for each valid frame,
+ * with a pointer into the receive buffer of the device. On error or end of file fp_read receives a NULL buffer.
+ * Frames are delivered without their delimiter, and with their length field and checksum.
+ * A framing type of E_ASYNC_FRAMING_NONE disables this mode.
+ */
+int async_set_framing(struct async_device * device, const ASYNC_FRAMING * framing) {
+
+    if (framing->type == E_ASYNC_FRAMING_NONE) {
+        free(device->framing.buf);
+        memset(&device->framing, 0x00, sizeof(device->framing));
+        device->read.framed = 0;
+        read_mode_update(device);
+        return 0;
+    }
+
+    if (check_uring_read_mode(device) < 0) {
+        return -1;
+    }
+
+    unsigned int min_size = 1;
+    switch (framing->type) {
+    case E_ASYNC_FRAMING_NONE:
+        break;
+    case E_ASYNC_FRAMING_FIXED:
+        min_size = framing->size;
+        if (framing->size == 0 || framing->size > framing->max_size) {
+            PRINT_ERROR_OTHER("invalid frame size");
+            return -1;
+        }
+        break;
+    case E_ASYNC_FRAMING_LENGTH:
+        min_size = framing->length.offset + framing->length.width;
+        if (framing->length.width == 0 || framing->length.width > 4 || min_size > framing->max_size) {
+            PRINT_ERROR_OTHER("invalid length field");
+            return -1;
+        }
+        break;
+    case E_ASYNC_FRAMING_DELIMITER:
+        break;
+    }
+
+    if (framing->checksum == E_ASYNC_CHECKSUM_CRC32C && framing->max_size < 4) {
+        PRINT_ERROR_OTHER("frames are too small for the checksum");
+        return -1;
+    }
+
+    if (framing->max_size < min_size || framing->max_size > UINT_MAX / 2) {
+        PRINT_ERROR_OTHER("invalid maximum frame size");
+        return -1;
+    }
+
+    // leave room for at least one more frame after an incomplete one
+    unsigned int size = framing->max_size * 2;
+
+    if (size != device->framing.size) {
+        void * ptr = malloc(size);
+        if (ptr == NULL) {
+            PRINT_ERROR_ALLOC_FAILED("malloc");
+            return -1;
+        }
+        free(device->framing.buf);
+        device->framing.buf = ptr;
+        device->framing.size = size;
+    }
+
+    device->framing.config = *framing;
+    device->framing.count = 0;
+    device->read.framed = 1;
+    read_mode_update(device);
+
+    return 0;
+}
+
+static int set_low_latency(struct async_device * device) {
+
+    struct serial_struct serial;
+    if (ioctl(device->fd, TIOCGSERIAL, &serial) < 0) {
+        return -1;
+    }
+    serial.flags |= ASYNC_LOW_LATENCY;
+    return ioctl(device->fd, TIOCSSERIAL, &serial);
+}
+
+/*
+ * The termios2 interface allows arbitrary baud rates.
+ */
+static int set_serial_params(struct async_device * device, const ASYNC_SERIAL_PARAMS * params) {
+
+    struct termios2 tio;
+    if (ioctl(device->fd, TCGETS2, &tio) < 0) {
+        PRINT_ERROR_ERRNO("ioctl TCGETS2");
+        return -1;
+    }
+
+    if (params->raw) {
+        tio.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL | IXON | IXOFF | IXANY);
+        tio.c_oflag &= ~OPOST;
+        tio.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+        tio.c_cflag &= ~(CSIZE | PARENB | CSTOPB | CRTSCTS);
+        tio.c_cflag |= CS8 | CLOCAL | CREAD;
+    }
+
+    if (params->baudrate > 0) {
+        tio.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT));
+        tio.c_cflag |= BOTHER | (BOTHER << IBSHIFT);
+        tio.c_ispeed = params->baudrate;
+        tio.c_ospeed = params->baudrate;
+    }
+
+    tio.c_cc[VMIN] = params->vmin;
+    tio.c_cc[VTIME] = params->vtime;
+
+    if (ioctl(device->fd, TCSETS2, &tio) < 0) {
+        PRINT_ERROR_ERRNO("ioctl TCSETS2");
+        return -1;
+    }
+
+    if (params->low_latency && set_low_latency(device) < 0) {
+        // not a serial driver (e.g. a pty), or not supported by the driver
+        if (GLOG_LEVEL(GLOG_NAME,INFO)) {
+            fprintf(stderr, "%s:%d %s: low latency mode is not supported by device (%s)\n", __FILE__, __LINE__, __func__, device->path);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Configure a serial device (or a pty).
+ * A baud rate of 0 keeps the current one, and arbitrary baud rates are supported.
+ * The low latency flag is set if requested and if the driver supports it, and is otherwise left as is.
+ */
+int async_set_serial_params(struct async_device * device, const ASYNC_SERIAL_PARAMS * params) {
+
+    if (!isatty(device->fd)) {
+        PRINT_ERROR_OTHER("not a serial device");
+        return -1;
+    }
+
+    return set_serial_params(device, params);
+}
+
+/*
+ * For serial devices, this applies latency-optimized defaults: raw mode, reads that return immediately,
+ * and the low latency flag (which for instance sets the FTDI latency timer to 1 ms instead of 16 ms).
+ * The baud rate is not changed.
+ */
+void async_set_device_type(struct async_device * device, e_async_device_type device_type) {
+
+    device->device_type = device_type;
+
+    if (device_type == E_ASYNC_DEVICE_TYPE_SERIAL && isatty(device->fd)) {
+        ASYNC_SERIAL_PARAMS params = {
+                .baudrate = 0,
+                .raw = 1,
+                .vmin = 0,
+                .vtime = 0,
+                .low_latency = 1,
+        };
+        set_serial_params(device, &params);
+    }
+}
+
+/*
+ * Writes scheduled with async_write_at are kept in a min-heap ordered by deadline (then by submission order),
+ * and a timerfd is armed for the earliest deadline, slightly ahead of it.
+ * The timer callback then spins until the deadline, so that the write does not depend on the timer slack.
+ *
+ * There is a pacer per poll loop, identified by the fp_register callback of the devices.
+ * Its heap is only accessed from the thread running that loop, and the list of pacers is protected by a lock.
+ */
+typedef struct
+{
+  gtime deadline;
+  unsigned long long seq;
+  struct async_device * device;
+  char * buf;
+  unsigned int count;
+} s_paced_write;
+
+struct async_pacer {
+    ASYNC_REGISTER_SOURCE fp_register; // identifies the poll loop
+    ASYNC_REMOVE_SOURCE fp_remove;
+    int timer; // registered to the poll loop
+    s_paced_write * heap;
+    unsigned int nb;
+    unsigned int size;
+    unsigned long long seq;
+    unsigned int users; // devices that scheduled writes, until they are closed
+    int dispatching; // the timer callback is running
+    struct async_pacer * next;
+};
+
+static struct async_pacer * pacers;
+static pthread_mutex_t pacers_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static inline int pacer_before(const s_paced_write * a, const s_paced_write * b) {
+
+    return a->deadline < b->deadline || (a->deadline == b->deadline && a->seq < b->seq);
+}
+
+static void pacer_sift_up(struct async_pacer * pacer, unsigned int index) {
+
+    s_paced_write entry = pacer->heap[index];
+    while (index > 0) {
+        unsigned int parent = (index - 1) / 2;
+        if (!pacer_before(&entry, pacer->heap + parent)) {
+            break;
+        }
+        pacer->heap[index] = pacer->heap[parent];
+        index = parent;
+    }
+    pacer->heap[index] = entry;
+}
+
+static void pacer_sift_down(struct async_pacer * pacer, unsigned int index) {
+
+    s_paced_write entry = pacer->heap[index];
+    for (;;) {
+        unsigned int child = 2 * index + 1;
+        if (child >= pacer->nb) {
+            break;
+        }
+        if (child + 1 < pacer->nb && pacer_before(pacer->heap + child + 1, pacer->heap + child)) {
+            ++child;
+        }
+        if (!pacer_before(pacer->heap + child, &entry)) {
+            break;
+        }
+        pacer->heap[index] = pacer->heap[child];
+        index = child;
+    }
+    pacer->heap[index] = entry;
+}
+
+static s_paced_write pacer_pop(struct async_pacer * pacer) {
+
+    s_paced_write first = pacer->heap[0];
+    if (--pacer->nb > 0) {
+        pacer->heap[0] = pacer->heap[pacer->nb];
+        pacer_sift_down(pacer, 0);
+    }
+    return first;
+}
+
+static int pacer_arm(struct async_pacer * pacer) {
+
+    struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+
+    if (pacer->nb > 0) {
+        gtime expiry = pacer->heap[0].deadline > ASYNC_PACING_LEAD ? pacer->heap[0].deadline - ASYNC_PACING_LEAD : 1;
+        its.it_value.tv_sec = expiry / 1000000000ULL;
+        its.it_value.tv_nsec = expiry % 1000000000ULL;
+        if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0) {
+            its.it_value.tv_nsec = 1; // a zero value disarms the timer
+        }
+    }
+
+    if (timerfd_settime(pacer->timer, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+        PRINT_ERROR_ERRNO("timerfd_settime");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * The lateness is measured right before the write syscall, and only accounted if the data was written
+ * without being queued: it is 0 for queued writes, which are written once the device is writable.
+ * The write status is stored in 'status', and the result of the callback is returned.
+ */
+static int pacer_write(s_paced_write * entry, int * status) {
+
+    struct async_device * device = entry->device;
+    struct iovec iov = { .iov_base = entry->buf, .iov_len = entry->count };
+
+    *status = flush_coalesced(device);
+    gtime lateness = 0;
+    if (*status == 0) {
+        gtime now = gtime_gettime();
+        *status = write_vector(device, &iov, 1, entry->count);
+        if (*status >= 0 && (unsigned int) *status == entry->count) {
+            lateness = now > entry->deadline ? now - entry->deadline : 0;
+            ++device->stats.paced_writes;
+            device->stats.paced_lateness_sum += lateness;
+            if (lateness > device->stats.paced_lateness_max) {
+                device->stats.paced_lateness_max = lateness;
+            }
+        }
+    }
+
+    free(entry->buf);
+
+    if (device->fp_write_at != NULL) {
+        return device->fp_write_at(device->callback.user, *status, lateness);
+    }
+
+    return 0;
+}
+
+static void pacer_free(struct async_pacer * pacer) {
+
+    if (pacer->fp_remove != NULL) {
+        pacer->fp_remove(pacer->timer);
+    }
+    close(pacer->timer);
+    free(pacer->heap);
+    free(pacer);
+}
+
+/*
+ * The pacer is freed once no device uses it, and once its timer callback returned.
+ */
+static void pacer_release(struct async_pacer * pacer) {
+
+    pthread_mutex_lock(&pacers_mutex);
+    int unused = (pacer->users == 0 && !pacer->dispatching);
+    if (unused) {
+        struct async_pacer ** current = &pacers;
+        while (*current != pacer) {
+            current = &(*current)->next;
+        }
+        *current = pacer->next;
+    }
+    pthread_mutex_unlock(&pacers_mutex);
+
+    if (unused) {
+        pacer_free(pacer);
+    }
+}
+
+static int pacer_callback(void * user) {
+
+    struct async_pacer * pacer = (struct async_pacer *) user;
+
+    uint64_t expirations;
+    if (read(pacer->timer, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+        PRINT_ERROR_ERRNO("read");
+    }
+
+    int ret = 0;
+
+    // fp_write_at may close devices, and release the pacer
+    pacer->dispatching = 1;
+
+    while (pacer->nb > 0) {
+        gtime now = gtime_gettime();
+        if (pacer->heap[0].deadline > now + ASYNC_PACING_LEAD) {
+            break;
+        }
+        while (now < pacer->heap[0].deadline) {
+            ASYNC_CPU_RELAX();
+            now = gtime_gettime();
+        }
+        s_paced_write entry = pacer_pop(pacer);
+        --entry.device->paced;
+        int status;
+        int res = pacer_write(&entry, &status);
+        if (res != 0) {
+            ret = res;
+        }
+    }
+
+    pacer->dispatching = 0;
+
+    if (pacer->users == 0) {
+        pacer_release(pacer);
+        return ret;
+    }
+
+    if (pacer_arm(pacer) < 0) {
+        ret = -1;
+    }
+
+    return ret;
+}
+
+static int pacer_close_callback(void * user __attribute__((unused))) {
+
+    PRINT_ERROR_OTHER("write timer failure");
+    return -1;
+}
+
+/*
+ * This function returns the pacer of the poll loop of the device, and creates it if needed.
+ */
+static struct async_pacer * pacer_get(struct async_device * device) {
+
+    pthread_mutex_lock(&pacers_mutex);
+
+    struct async_pacer * pacer;
+    for (pacer = pacers; pacer != NULL; pacer = pacer->next) {
+        if (pacer->fp_register == device->callback.fp_register) {
+            ++pacer->users;
+            pthread_mutex_unlock(&pacers_mutex);
+            return pacer;
+        }
+    }
+
+    pacer = calloc(1, sizeof(*pacer));
+    if (pacer == NULL) {
+        pthread_mutex_unlock(&pacers_mutex);
+        PRINT_ERROR_ALLOC_FAILED("calloc");
+        return NULL;
+    }
+
+    pacer->timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (pacer->timer < 0) {
+        pthread_mutex_unlock(&pacers_mutex);
+        PRINT_ERROR_ERRNO("timerfd_create");
+        free(pacer);
+        return NULL;
+    }
+
+    GPOLL_CALLBACKS gpoll_callbacks = {
+            .fp_read = pacer_callback,
+            .fp_write = NULL,
+            .fp_close = pacer_close_callback,
+    };
+    if (device->callback.fp_register(pacer->timer, pacer, &gpoll_callbacks) < 0) {
+        pthread_mutex_unlock(&pacers_mutex);
+        close(pacer->timer);
+        free(pacer);
+        return NULL;
+    }
+
+    pacer->fp_register = device->callback.fp_register;
+    pacer->fp_remove = device->callback.fp_remove;
+    pacer->users = 1;
+    pacer->next = pacers;
+    pacers = pacer;
+
+    pthread_mutex_unlock(&pacers_mutex);
+
+    return pacer;
+}
+
+/*
+ * Pending writes of a closed device are dropped, and the pacer is released if no other device uses it.
+ * Only registered devices have a pacer, and these are closed from the thread running the poll loop.
+ */
+static void pacer_remove_device(struct async_device * device) {
+
+    struct async_pacer * pacer = device->pacer;
+
+    if (pacer == NULL) {
+        return;
+    }
+
+    device->pacer = NULL;
+
+    if (device->paced > 0) {
+
+        device->paced = 0;
+
+        unsigned int i, nb = 0;
+        for (i = 0; i < pacer->nb; ++i) {
+            if (pacer->heap[i].device == device) {
+                free(pacer->heap[i].buf);
+            }
+            else {
+                pacer->heap[nb++] = pacer->heap[i];
+            }
+        }
+
+        pacer->nb = nb;
+        for (i = nb / 2; i > 0; --i) {
+            pacer_sift_down(pacer, i - 1);
+        }
+        pacer_arm(pacer);
+    }
+
+    pthread_mutex_lock(&pacers_mutex);
+    --pacer->users;
+    pthread_mutex_unlock(&pacers_mutex);
+
+    pacer_release(pacer);
+}
+
+/*
+ * Schedule a write at 'deadline' (a gtime value, i.e. the monotonic clock in nanoseconds).
+ * The data is copied, and is written through the regular write path when the deadline is reached,
+ * or immediately if it is already past. The lateness of each write is reported to the callback
+ * set with async_set_write_at_callback, and accumulated in the device statistics,
+ * unless the write has to be queued.
+ * The device has to be registered, and writes are paced from the poll loop it is registered to.
+ *
+ * Returns 0 on success, or -1 on failure.
+ */
+int async_write_at(struct async_device * device, const void * buf, unsigned int count, gtime deadline) {
+
+    if (device->callback.fp_register == NULL) {
+        PRINT_ERROR_OTHER("the device is not registered");
+        return -1;
+    }
+
+    s_paced_write entry = {
+            .deadline = deadline,
+            .device = device,
+            .buf = malloc(count > 0 ? count : 1),
+            .count = count,
+    };
+    if (entry.buf == NULL) {
+        PRINT_ERROR_ALLOC_FAILED("malloc");
+        return -1;
+    }
+    memcpy(entry.buf, buf, count);
+
+    if (deadline <= gtime_gettime()) {
+        int status;
+        pacer_write(&entry, &status);
+        return status < 0 ? -1 : 0;
+    }
+
+    if (device->pacer == NULL) {
+        device->pacer = pacer_get(device);
+        if (device->pacer == NULL) {
+            free(entry.buf);
+            return -1;
+        }
+    }
+
+    struct async_pacer * pacer = device->pacer;
+
+    entry.seq = pacer->seq++;
+
+    if (pacer->nb == pacer->size) {
+        unsigned int size = pacer->size ? pacer->size * 2 : ASYNC_INDEX_MIN_SIZE;
+        void * ptr = realloc(pacer->heap, size * sizeof(*pacer->heap));
+        if (ptr == NULL) {
+            PRINT_ERROR_ALLOC_FAILED("realloc");
+            free(entry.buf);
+            return -1;
+        }
+        pacer->heap = ptr;
+        pacer->size = size;
+    }
+
+    pacer->heap[pacer->nb] = entry;
+    pacer_sift_up(pacer, pacer->nb++);
+    ++device->paced;
+
+    if (pacer->heap[0].seq == entry.seq) {
+        return pacer_arm(pacer);
+    }
+
+    return 0;
+}
+
+void async_set_write_at_callback(struct async_device * device, ASYNC_WRITE_AT_CALLBACK fp) {
+
+    device->fp_write_at = fp;
+}
+
+/*
+ * Enable busy polling: instead of sleeping, reads are retried for up to 'spin' microseconds,
+ * when the next packet is expected within that time according to the recent inter-arrival times.
+ * This applies to async_read_timeout, and to registered devices in the default read mode
+ * (not in batched, lending or framing modes) using the poll engine, where the poll loop is blocked while spinning.
+ * A value of 0 disables busy polling.
+ */
+int async_set_busy_poll(struct async_device * device, unsigned int spin) {
+
+    if (spin > 0 && check_uring_read_mode(device) < 0) {
+        return -1;
+    }
+
+    device->busy_poll.spin = spin;
+    device->busy_poll.interval = 0;
+    device->busy_poll.last = 0;
+    read_mode_update(device);
+
+    return 0;
+}
+
+/*
+ * Record the data read from and written to the device into a binary file, in append mode.
+ * Reads are recorded when delivered, writes when submitted (after coalescing).
+ * Recording stops with a NULL path, or when the device is closed.
+ */
+int async_set_record(struct async_device * device, const char * path) {
+
+    if (device->record != NULL) {
+        if (fclose(device->record) == EOF) {
+            PRINT_ERROR_ERRNO("fclose");
+        }
+        device->record = NULL;
+    }
+
+    if (path == NULL) {
+        return 0;
+    }
+
+    FILE * file = fopen(path, "ab");
+    if (file == NULL) {
+        PRINT_ERROR_ERRNO("fopen");
+        return -1;
+    }
+
+    setvbuf(file, NULL, _IOFBF, ASYNC_RECORD_BUFFER_SIZE);
+
+    if (fseek(file, 0, SEEK_END) < 0 || ftell(file) < 0) {
+        PRINT_ERROR_ERRNO("fseek");
+        fclose(file);
+        return -1;
+    }
+
+    if (ftell(file) == 0) {
+        s_record_file_header header = { .magic = ASYNC_RECORD_MAGIC, .version = ASYNC_RECORD_VERSION };
+        if (fwrite(&header, sizeof(header), 1, file) != 1) {
+            PRINT_ERROR_ERRNO("fwrite");
+            fclose(file);
+            return -1;
+        }
+    }
+
+    device->record = file;
+
+    return 0;
+}
+
+/*
+ * Open a record file as a device. Once registered, the recorded reads are delivered to fp_read,
+ * with the recorded timing divided by 'speed', or as fast as possible if 'speed' is 0.
+ * Buffers point into the mapped file, and remain valid until the device is closed.
+ * Writes are discarded.
+ */
+struct async_device * async_open_replay(const char * path, double speed) {
+
+    int file = open(path, O_RDONLY | O_CLOEXEC);
+    if (file < 0) {
+        PRINT_ERROR_ERRNO("open");
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(file, &st) < 0) {
+        PRINT_ERROR_ERRNO("fstat");
+        close(file);
+        return NULL;
+    }
+
+    s_record_file_header header;
+    if ((size_t) st.st_size < sizeof(header)) {
+        PRINT_ERROR_OTHER("not a record file");
+        close(file);
+        return NULL;
+    }
+
+    void * data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+    close(file);
+    if (data == MAP_FAILED) {
+        PRINT_ERROR_ERRNO("mmap");
+        return NULL;
+    }
+
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, ASYNC_RECORD_MAGIC, sizeof(header.magic)) || header.version != ASYNC_RECORD_VERSION) {
+        PRINT_ERROR_OTHER("not a record file");
+        munmap(data, st.st_size);
+        return NULL;
+    }
+
+    s_replay * replay = calloc(1, sizeof(*replay));
+    if (replay == NULL) {
+        PRINT_ERROR_ALLOC_FAILED("calloc");
+        munmap(data, st.st_size);
+        return NULL;
+    }
+    replay->data = data;
+    replay->size = st.st_size;
+    replay->offset = sizeof(header);
+    replay->speed = speed;
+
+    if (replay->offset + sizeof(s_record_header) <= replay->size) {
+        s_record_header first;
+        memcpy(&first, replay->data + replay->offset, sizeof(first));
+        replay->origin = first.time;
+    }
+
+    int timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer < 0) {
+        PRINT_ERROR_ERRNO("timerfd_create");
+        munmap(data, st.st_size);
+        free(replay);
+        return NULL;
+    }
+
+    struct async_device * device = add_device(path, timer, 1);
+    if (device == NULL) {
+        close(timer);
+        munmap(data, st.st_size);
+        free(replay);
+        return NULL;
+    }
+
+    device->replay = replay;
+    read_mode_update(device);
+
+    return device;
+}
+
+static int open_pty(int * peer, char * name, size_t size) {
+
+    int master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (master < 0) {
+        PRINT_ERROR_ERRNO("posix_openpt");
+        return -1;
+    }
+
+    if (grantpt(master) < 0 || unlockpt(master) < 0 || ptsname_r(master, name, size) != 0) {
+        PRINT_ERROR_ERRNO("ptsname");
+        close(master);
+        return -1;
+    }
+
+    int fd = open(name, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        PRINT_ERROR_ERRNO("open");
+        close(master);
+        return -1;
+    }
+
+    *peer = master;
+    return fd;
+}
+
+/*
+ * Open a virtual device, and return the other end in 'peer', which is left in blocking mode,
+ * and has to be closed by the caller.
+ * A packet device preserves message boundaries (like hidraw), a stream device does not (like a tty),
+ * and a pty device is the slave side of a pty, set to raw mode (the peer is the master side).
+ * Virtual devices are named "virtual:N", except pty devices, which are named after the slave.
+ */
+struct async_device * async_open_virtual(e_async_virtual type, int * peer) {
+
+    static unsigned int count = 0;
+
+    char name[64];
+    int fd = -1;
+
+    switch (type) {
+    case E_ASYNC_VIRTUAL_PACKET:
+    case E_ASYNC_VIRTUAL_STREAM:
+    {
+        int sv[2];
+        if (socketpair(AF_UNIX, (type == E_ASYNC_VIRTUAL_PACKET ? SOCK_SEQPACKET : SOCK_STREAM) | SOCK_CLOEXEC, 0, sv) < 0) {
+            PRINT_ERROR_ERRNO("socketpair");
+            return NULL;
+        }
+        if (fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK) < 0) {
+            PRINT_ERROR_ERRNO("fcntl");
+            close(sv[0]);
+            close(sv[1]);
+            return NULL;
+        }
+        fd = sv[0];
+        *peer = sv[1];
+        snprintf(name, sizeof(name), "virtual:%u", __atomic_fetch_add(&count, 1, __ATOMIC_RELAXED));
+        break;
+    }
+    case E_ASYNC_VIRTUAL_PTY:
+        fd = open_pty(peer, name, sizeof(name));
+        if (fd < 0) {
+            return NULL;
+        }
+        break;
+    }
+
+    if (fd < 0) {
+        PRINT_ERROR_OTHER("invalid virtual device type");
+        return NULL;
+    }
+
+    struct async_device * device = add_device(name, fd, 1);
+    if (device == NULL) {
+        close(fd);
+        close(*peer);
+        return NULL;
+    }
+
+    if (type == E_ASYNC_VIRTUAL_PTY) {
+        ASYNC_SERIAL_PARAMS params = { .raw = 1 };
+        if (set_serial_params(device, &params) < 0) {
+            async_close(device);
+            close(*peer);
+            return NULL;
+        }
+    }
+
+    return device;
+}
+
+void async_set_write_policy(struct async_device * device, e_async_write_policy policy) {
+
+    device->write.policy = policy;
+}
+
+int async_write(struct async_device * device, const void * buf, unsigned int count) {
+
+    struct iovec iov = { .iov_base = (void *) buf, .iov_len = count };
+
+    return async_writev(device, &iov, 1);
+}
+
+static int pool_init(unsigned int capacity, unsigned int read_size, unsigned int slots) {
+
+    if (pool.capacity > 0 || !GLIST_IS_EMPTY(async_devices)) {
+        PRINT_ERROR_OTHER("the pool can only be initialized before opening devices");
+        return -1;
+    }
+
+    if (capacity == 0 || read_size == 0 || slots == 0
+            || (size_t) read_size * slots > UINT_MAX || capacity > UINT_MAX / ASYNC_POOL_PATH_SIZE) {
+        PRINT_ERROR_OTHER("invalid pool size");
+        return -1;
+    }
+
+    while (path_index.size < capacity) {
+        if (path_index_grow() < 0) {
+            return -1;
+        }
+    }
+
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur > 0) {
+        rlim_t fds = limit.rlim_cur < ASYNC_POOL_MAX_FDS ? limit.rlim_cur : ASYNC_POOL_MAX_FDS;
+        if ((fd_index == NULL || fd_index->size < fds) && fd_index_set(fds - 1, NULL) < 0) {
+            return -1;
+        }
+    }
+
+    pool.devices = aligned_alloc(ASYNC_CACHE_LINE_SIZE, capacity * sizeof(*pool.devices));
+    pool.paths = malloc((size_t) capacity * ASYNC_POOL_PATH_SIZE);
+    pool.read_bufs = malloc((size_t) capacity * slots * read_size);
+    pool.status = malloc((size_t) capacity * slots * sizeof(*pool.status));
+    if (pool.devices == NULL || pool.paths == NULL || pool.read_bufs == NULL || pool.status == NULL) {
+        PRINT_ERROR_ALLOC_FAILED("malloc");
+        free(pool.devices);
+        free(pool.paths);
+        free(pool.read_bufs);
+        free(pool.status);
+        memset(&pool, 0x00, sizeof(pool));
+        return -1;
+    }
+
+    unsigned int i;
+    for (i = capacity; i > 0; --i) {
+        pool.devices[i - 1].hnext = pool.free;
+        pool.free = pool.devices + i - 1;
+    }
+
+    pool.capacity = capacity;
+    pool.read_size = read_size;
+    pool.slots = slots;
+
+    return 0;
+}
+
+/*
+ * Preallocate devices, paths, read buffers and index tables.
+ * Once done, opening and closing up to 'capacity' devices does not allocate memory,
+ * as long as the read size does not exceed 'read_size' and the number of read slots does not exceed 'slots'.
+ * Writes that can't complete immediately still allocate memory when queued,
+ * and so do fds beyond RLIMIT_NOFILE (capped to ASYNC_POOL_MAX_FDS) at init time.
+ * This has to be called before opening any device.
+ */
+int async_pool_init(unsigned int capacity, unsigned int read_size, unsigned int slots) {
+
+    registry_lock();
+    int ret = pool_init(capacity, read_size, slots);
+    registry_unlock();
+
+    return ret;
+}
+
+int async_get_stats(struct async_device * device, ASYNC_STATS * stats) {
+
+    *stats = device->stats;
+
+    if (device->stats.packets_read > 0) {
+        struct timespec now;
+#ifdef CLOCK_MONOTONIC_COARSE
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+#else
+        clock_gettime(CLOCK_MONOTONIC, &now);
+#endif
+        stats->since_last_packet = (now.tv_sec - device->last_packet.tv_sec) * 1000000000LL + (now.tv_nsec - device->last_packet.tv_nsec);
+    }
+    else {
+        stats->since_last_packet = -1;
+    }
+
+    if (device->reader != NULL) {
+        stats->dropped_reads = __atomic_load_n(&device->reader->dropped, __ATOMIC_RELAXED);
+    }
+
+    return 0;
+}
+
+/*
+ * Call fp for each open device, until fp returns a non-zero value, which is then returned.
+ * The registry lock is held during the iteration: fp may close the device it is called for,
+ * but other threads can't open or close devices until the iteration ends.
+ */
+int async_for_each_device(ASYNC_DEVICE_CALLBACK fp, void * user) {
+
+    int ret = 0;
+
+    registry_lock();
+
+    struct async_device * current = GLIST_BEGIN(async_devices);
+    while (current != GLIST_END(async_devices)) {
+        struct async_device * next = current->next;
+        ret = fp(user, current);
+        if (ret != 0) {
+            break;
+        }
+        current = next;
+    }
+
+    registry_unlock();
+
+    return ret;
+}
+
+const char * async_get_path(struct async_device * device) {
+
+    return device->path;
+}
+
+int async_get_fd(struct async_device * device) {
 
     return device->fd;
 }
+
+/*
+ * This function does not lock, and can be called from any thread.
+ * The caller has to make sure the device is not closed while it uses it, or use async_acquire_device.
+ */
+struct async_device * async_get_device(int fd) {
+
+    s_fd_table * table = __atomic_load_n(&fd_index, __ATOMIC_ACQUIRE);
+
+    if (fd < 0 || table == NULL || (unsigned int) fd >= table->size) {
+        return NULL;
+    }
+
+    return __atomic_load_n(&table->devices[fd], __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Look up a device by fd and take a reference on it. This function does not lock, and can be called from any thread.
+ * The device memory and its path remain valid until the reference is dropped with async_release_device,
+ * even if the device gets closed by another thread. A closed device must not be used for anything else
+ * than async_get_path and async_get_stats.
+ */
+struct async_device * async_acquire_device(int fd) {
+
+    unsigned int slot = __atomic_load_n(&lookups.epoch, __ATOMIC_SEQ_CST) & 1;
+    __atomic_fetch_add(&lookups.readers[slot], 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST); // orders the reader count before the lookup
+
+    struct async_device * device = async_get_device(fd);
+
+    if (device != NULL) {
+        unsigned int refs = __atomic_load_n(&device->refs, __ATOMIC_RELAXED);
+        do {
+            if (refs == 0) {
+                device = NULL; // being released
+                break;
+            }
+        } while (!__atomic_compare_exchange_n(&device->refs, &refs, refs + 1, 1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+    }
+
+    __atomic_fetch_sub(&lookups.readers[slot], 1, __ATOMIC_RELEASE);
+
+    return device;
+}
+
+void async_release_device(struct async_device * device) {
+
+    release_device(device);
+}
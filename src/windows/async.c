@@ -22,6 +22,7 @@ typedef struct
   struct
   {
     char * buf;
+    unsigned int size;
     unsigned int count;
   } data[ASYNC_MAX_WRITE_QUEUE_SIZE];
   unsigned int nb;
@@ -43,6 +44,7 @@ struct async_device {
       OVERLAPPED overlapped;
       s_queue queue;
       unsigned int size;
+      e_async_write_policy policy;
     } write;
     struct {
         void * user;
@@ -91,26 +93,55 @@ static struct async_device * add_device(const char * path, HANDLE handle, int pr
     return device;
 }
 
+/*
+ * The first queued write is always in flight.
+ * When the queue is full the oldest pending write is dropped with E_ASYNC_WRITE_POLICY_DROP_OLDEST.
+ * With E_ASYNC_WRITE_POLICY_REPLACE the last pending write is overwritten in place.
+ */
 static int queue_write(struct async_device * device, const char * buf, unsigned int count) {
-  if(device->write.queue.nb == ASYNC_MAX_WRITE_QUEUE_SIZE) {
-      if (GLOG_LEVEL(GLOG_NAME,ERROR)) {
-          fprintf(stderr, "%s:%d %s: no space left in write queue for device (%s)\n", __FILE__, __LINE__, __func__, device->path);
+  unsigned int index = device->write.queue.nb;
+  if(device->write.policy == E_ASYNC_WRITE_POLICY_REPLACE && index > 1) {
+      --index; // replace the last pending write
+  }
+  else if(index == ASYNC_MAX_WRITE_QUEUE_SIZE) {
+      if(device->write.policy != E_ASYNC_WRITE_POLICY_DROP_OLDEST || index < 2) {
+          if (GLOG_LEVEL(GLOG_NAME,ERROR)) {
+              fprintf(stderr, "%s:%d %s: no space left in write queue for device (%s)\n", __FILE__, __LINE__, __func__, device->path);
+          }
+          return -1;
       }
-      return -1;
+      free(device->write.queue.data[1].buf);
+      memmove(device->write.queue.data + 1, device->write.queue.data + 2, (index - 2) * sizeof(*device->write.queue.data));
+      --device->write.queue.nb;
+      --index;
+      device->write.queue.data[index].buf = NULL;
+      device->write.queue.data[index].size = 0;
+  }
+  else {
+      device->write.queue.data[index].buf = NULL;
+      device->write.queue.data[index].size = 0;
   }
+  unsigned int length = count;
   if(count < device->write.size) {
       count = device->write.size;
   }
-  void * dup = calloc(count, sizeof(char));
-  if(!dup) {
-      PRINT_ERROR_ALLOC_FAILED("malloc");
-      return -1;
+  char * dup = device->write.queue.data[index].buf;
+  if(count > device->write.queue.data[index].size) {
+      dup = realloc(dup, count);
+      if(!dup) {
+          PRINT_ERROR_ALLOC_FAILED("realloc");
+          return -1;
+      }
+      device->write.queue.data[index].buf = dup;
+      device->write.queue.data[index].size = count;
   }
-  memcpy(dup, buf, count);
-  device->write.queue.data[device->write.queue.nb].buf = dup;
-  device->write.queue.data[device->write.queue.nb].count = count;
-  ++device->write.queue.nb;
-  return device->write.queue.nb - 1;
+  memcpy(dup, buf, length);
+  memset(dup + length, 0x00, count - length);
+  device->write.queue.data[index].count = count;
+  if(index == device->write.queue.nb) {
+      ++device->write.queue.nb;
+  }
+  return index;
 }
 
 static int dequeue_write(struct async_device * device) {
@@ -561,6 +592,11 @@ int async_write(struct async_device * device, const void * buf, unsigned int cou
     return ret;
 }
 
+void async_set_write_policy(struct async_device * device, e_async_write_policy policy) {
+
+    device->write.policy = policy;
+}
+
 void async_set_private(struct async_device * device, void * priv) {
 
     device->priv = priv;
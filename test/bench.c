@@ -0,0 +1,241 @@
+/*
+ Copyright (c) 2026 Mathieu Laurendeau <mat.lau@laposte.net>
+ License: GPLv3
+ */
+
+/*
+ * Round-trip benchmark of the async layer (POSIX only), through virtual packet devices and an echo thread.
+ * Each packet carries its send time, and the latency is measured when the echoed packet is delivered to fp_read.
+ * Results are written as CSV lines:
+ * engine,size,window,packets,p50_ns,p99_ns,p999_ns,packets_per_s,bytes_per_s
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <gimxcommon/include/async.h>
+#include <gimxpoll/include/gpoll.h>
+#include <gimxtime/include/gtime.h>
+
+#define BENCH_MAX_SIZE 4096
+
+static const unsigned int bench_sizes[] = { 8, 32, 64, 256, 1024, 4096 };
+
+static const struct {
+    e_async_engine engine;
+    const char * name;
+} bench_engines[] = {
+    { E_ASYNC_ENGINE_POLL, "poll" },
+    { E_ASYNC_ENGINE_IO_URING, "io_uring" },
+};
+
+typedef struct {
+    struct async_device * device;
+    unsigned int size;
+    unsigned int packets;
+    unsigned int sent;
+    unsigned int received;
+    gtime * latencies;
+    int error;
+} s_bench;
+
+static void * bench_echo(void * arg) {
+
+    int peer = *(int *) arg;
+    char buf[BENCH_MAX_SIZE];
+    int res;
+    while ((res = read(peer, buf, sizeof(buf))) > 0) {
+        if (write(peer, buf, res) != res) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+static int bench_send(s_bench * bench) {
+
+    char buf[BENCH_MAX_SIZE] = { 0 };
+    gtime now = gtime_gettime();
+    memcpy(buf, &now, sizeof(now));
+    ++bench->sent;
+    return async_write(bench->device, buf, bench->size);
+}
+
+static int bench_read(void * user, const void * buf, int status) {
+
+    s_bench * bench = (s_bench *) user;
+
+    if (status != (int) bench->size) {
+        fprintf(stderr, "bench: unexpected read status %d\n", status);
+        bench->error = 1;
+        return 1;
+    }
+
+    gtime sent;
+    memcpy(&sent, buf, sizeof(sent));
+    bench->latencies[bench->received++] = gtime_gettime() - sent;
+
+    if (bench->received == bench->packets) {
+        return 1; // makes gpoll return
+    }
+
+    if (bench->sent < bench->packets && bench_send(bench) < 0) {
+        bench->error = 1;
+        return 1;
+    }
+
+    return 0;
+}
+
+static int bench_close(void * user) {
+
+    s_bench * bench = (s_bench *) user;
+    bench->error = 1;
+    return 1;
+}
+
+static int bench_compare(const void * a, const void * b) {
+
+    gtime ga = *(const gtime *) a;
+    gtime gb = *(const gtime *) b;
+    return (ga > gb) - (ga < gb);
+}
+
+static gtime bench_percentile(const gtime * sorted, unsigned int nb, double percentile) {
+
+    unsigned int index = (unsigned int) (percentile * nb / 100);
+    return sorted[index < nb ? index : nb - 1];
+}
+
+static void bench_header(FILE * out) {
+
+    fprintf(out, "engine,size,window,packets,p50_ns,p99_ns,p999_ns,packets_per_s,bytes_per_s\n");
+}
+
+/*
+ * Run a benchmark with 'window' packets in flight, and append a result line to 'out'.
+ * Returns 1 if the engine is not supported or not available, 0 on success, or -1 on failure.
+ */
+static int bench_async(unsigned int engine, unsigned int size, unsigned int packets, unsigned int window, FILE * out) {
+
+    if (size < sizeof(gtime) || size > BENCH_MAX_SIZE || packets == 0 || window == 0) {
+        fprintf(stderr, "bench: invalid parameters\n");
+        return -1;
+    }
+
+    s_bench bench = { .size = size, .packets = packets };
+    bench.latencies = calloc(packets, sizeof(*bench.latencies));
+    if (bench.latencies == NULL) {
+        fprintf(stderr, "bench: calloc failed\n");
+        return -1;
+    }
+
+    int peer;
+    bench.device = async_open_virtual(E_ASYNC_VIRTUAL_PACKET, &peer);
+    if (bench.device == NULL) {
+        free(bench.latencies);
+        return -1;
+    }
+
+    if (async_set_engine(bench.device, bench_engines[engine].engine) < 0) {
+        async_close(bench.device);
+        close(peer);
+        free(bench.latencies);
+        return 1;
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, bench_echo, &peer) != 0) {
+        fprintf(stderr, "bench: pthread_create failed\n");
+        async_close(bench.device);
+        close(peer);
+        free(bench.latencies);
+        return -1;
+    }
+
+    ASYNC_CALLBACKS callbacks = {
+            .fp_read = bench_read,
+            .fp_close = bench_close,
+            .fp_register = gpoll_register_fd,
+            .fp_remove = gpoll_remove_fd,
+    };
+
+    int ret = 0;
+
+    if (async_set_read_size(bench.device, size) < 0 || async_register(bench.device, &bench, &callbacks) < 0) {
+        ret = -1;
+    }
+    else if (async_get_engine(bench.device) != bench_engines[engine].engine) {
+        // the device fell back to another engine at registration time
+        fprintf(stderr, "bench: the %s engine is not available\n", bench_engines[engine].name);
+        ret = 1;
+    }
+
+    gtime start = gtime_gettime();
+
+    while (ret == 0 && bench.sent < window && bench.sent < packets) {
+        if (bench_send(&bench) < 0) {
+            ret = -1;
+        }
+    }
+
+    while (ret == 0 && !bench.error && bench.received < packets) {
+        gpoll();
+    }
+
+    gtime elapsed = gtime_gettime() - start;
+
+    async_close(bench.device);
+    shutdown(peer, SHUT_RDWR); // stops the echo thread
+    pthread_join(thread, NULL);
+    close(peer);
+
+    if (ret == 0 && bench.error) {
+        ret = -1;
+    }
+
+    if (ret == 0) {
+        qsort(bench.latencies, packets, sizeof(*bench.latencies), bench_compare);
+        double seconds = elapsed / 1e9;
+        fprintf(out, "%s,%u,%u,%u," GTIME_FS "," GTIME_FS "," GTIME_FS ",%.0f,%.0f\n", bench_engines[engine].name, size, window, packets,
+                bench_percentile(bench.latencies, packets, 50), bench_percentile(bench.latencies, packets, 99),
+                bench_percentile(bench.latencies, packets, 99.9), packets / seconds, (double) packets * size / seconds);
+        fflush(out);
+    }
+
+    free(bench.latencies);
+
+    return ret;
+}
+
+/*
+ * Run the benchmark for each engine and each report size, and write the results to 'path'.
+ */
+static int bench_async_all(const char * path, unsigned int packets, unsigned int window) {
+
+    FILE * out = fopen(path, "w");
+    if (out == NULL) {
+        fprintf(stderr, "bench: can't open %s\n", path);
+        return -1;
+    }
+
+    bench_header(out);
+
+    int ret = 0;
+
+    unsigned int engine, size;
+    for (engine = 0; engine < sizeof(bench_engines) / sizeof(*bench_engines); ++engine) {
+        for (size = 0; size < sizeof(bench_sizes) / sizeof(*bench_sizes); ++size) {
+            if (bench_async(engine, bench_sizes[size], packets, window, out) < 0) {
+                ret = -1;
+            }
+        }
+    }
+
+    fclose(out);
+
+    return ret;
+}
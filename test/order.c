@@ -0,0 +1,147 @@
+/*
+ Copyright (c) 2026 Mathieu Laurendeau <mat.lau@laposte.net>
+ License: GPLv3
+ */
+
+/*
+ * Write ordering test of the async layer (POSIX only), through a virtual stream device.
+ * A small asynchronous write is followed by a large one, which can only be partially written,
+ * and by a synchronous write, which has to be received last.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <gimxcommon/include/async.h>
+#include <gimxpoll/include/gpoll.h>
+
+#define ORDER_LARGE_SIZE (1024 * 1024) // more than the socket buffers
+
+static const char order_head[] = "AAAA";
+static const char order_tail[] = "ZZZZ";
+
+typedef struct {
+    int peer;
+    char * buf;
+    unsigned int size;
+    unsigned int received;
+} s_order_reader;
+
+static void * order_read(void * arg) {
+
+    s_order_reader * reader = (s_order_reader *) arg;
+    int res;
+    while (reader->received < reader->size
+            && (res = read(reader->peer, reader->buf + reader->received, reader->size - reader->received)) > 0) {
+        reader->received += res;
+    }
+    return NULL;
+}
+
+static int order_write(void * user, int status) {
+
+    int * completed = (int *) user;
+    if (status == ORDER_LARGE_SIZE) {
+        *completed = 1;
+    }
+    return 0;
+}
+
+static int order_close(void * user __attribute__((unused))) {
+
+    return 1;
+}
+
+/*
+ * Returns 0 if the data is received in order, or -1 on failure.
+ */
+static int order_async(void) {
+
+    unsigned int size = sizeof(order_head) - 1 + ORDER_LARGE_SIZE + sizeof(order_tail) - 1;
+
+    char * large = malloc(ORDER_LARGE_SIZE);
+    s_order_reader reader = { .buf = malloc(size), .size = size };
+    if (large == NULL || reader.buf == NULL) {
+        fprintf(stderr, "order: malloc failed\n");
+        free(large);
+        free(reader.buf);
+        return -1;
+    }
+    memset(large, 'B', ORDER_LARGE_SIZE);
+
+    struct async_device * device = async_open_virtual(E_ASYNC_VIRTUAL_STREAM, &reader.peer);
+    if (device == NULL) {
+        free(large);
+        free(reader.buf);
+        return -1;
+    }
+
+    int completed = 0;
+
+    ASYNC_CALLBACKS callbacks = {
+            .fp_write = order_write,
+            .fp_close = order_close,
+            .fp_register = gpoll_register_fd,
+            .fp_remove = gpoll_remove_fd,
+    };
+
+    int ret = 0;
+
+    if (async_register(device, &completed, &callbacks) < 0) {
+        ret = -1;
+    }
+    else if (async_write(device, order_head, sizeof(order_head) - 1) != sizeof(order_head) - 1) {
+        fprintf(stderr, "order: the first write should complete immediately\n");
+        ret = -1;
+    }
+    else if (async_write(device, large, ORDER_LARGE_SIZE) != 0) {
+        fprintf(stderr, "order: the large write should be queued\n");
+        ret = -1;
+    }
+
+    pthread_t thread;
+    if (ret == 0 && pthread_create(&thread, NULL, order_read, &reader) != 0) {
+        fprintf(stderr, "order: pthread_create failed\n");
+        ret = -1;
+    }
+
+    if (ret == 0) {
+        // the queued data has to be written first
+        if (async_write_timeout(device, order_tail, sizeof(order_tail) - 1, 1000) != sizeof(order_tail) - 1) {
+            fprintf(stderr, "order: the synchronous write failed\n");
+            ret = -1;
+        }
+        else if (!completed) {
+            fprintf(stderr, "order: the queued write was not reported to fp_write\n");
+            ret = -1;
+        }
+        if (ret < 0) {
+            shutdown(reader.peer, SHUT_RD); // the data may be incomplete, stop the reader thread
+        }
+        pthread_join(thread, NULL);
+    }
+
+    async_close(device);
+    close(reader.peer);
+
+    if (ret == 0) {
+        if (reader.received != size) {
+            fprintf(stderr, "order: received %u bytes instead of %u\n", reader.received, size);
+            ret = -1;
+        }
+        else if (memcmp(reader.buf, order_head, sizeof(order_head) - 1)
+                || memcmp(reader.buf + sizeof(order_head) - 1, large, ORDER_LARGE_SIZE)
+                || memcmp(reader.buf + size - (sizeof(order_tail) - 1), order_tail, sizeof(order_tail) - 1)) {
+            fprintf(stderr, "order: the data was reordered\n");
+            ret = -1;
+        }
+    }
+
+    free(large);
+    free(reader.buf);
+
+    return ret;
+}
@@ -0,0 +1,218 @@
+/*
+ Copyright (c) 2026 Mathieu Laurendeau <mat.lau@laposte.net>
+ License: GPLv3
+ */
+
+/*
+ * Scalability stress test of the async layer (POSIX only).
+ * For each device count, open that many virtual packet devices, register them all through gpoll,
+ * and pump packets through a random subset of them.
+ * Results are written as CSV lines:
+ * devices,open_ns,close_ns,dispatch_ns,bytes_per_device
+ * open_ns and close_ns are per device, dispatch_ns is per delivered packet,
+ * and bytes_per_device is the resident memory growth divided by the device count.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <gimxcommon/include/async.h>
+#include <gimxpoll/include/gpoll.h>
+#include <gimxtime/include/gtime.h>
+
+#define STRESS_PACKET_SIZE 64
+#define STRESS_SUBSET 64
+#define STRESS_ROUNDS 100
+
+static const unsigned int stress_counts[] = { 1, 10, 100, 1000, 10000 };
+
+typedef struct {
+    struct async_device * device;
+    int peer;
+} s_stress_device;
+
+static unsigned int stress_pending = 0;
+
+static int stress_read(void * user __attribute__((unused)), const void * buf __attribute__((unused)), int status) {
+
+    if (status < 0) {
+        stress_pending = 0;
+        return 1;
+    }
+    /*
+     * Returning a non-zero value makes gpoll return once all the pumped packets are delivered.
+     */
+    return --stress_pending == 0;
+}
+
+static int stress_close(void * user __attribute__((unused))) {
+
+    stress_pending = 0;
+    return 1;
+}
+
+/*
+ * Resident memory, in bytes, or 0 if it can't be read.
+ */
+static unsigned long stress_resident(void) {
+
+    unsigned long size, resident = 0;
+    FILE * file = fopen("/proc/self/statm", "r");
+    if (file != NULL) {
+        if (fscanf(file, "%lu %lu", &size, &resident) != 2) {
+            resident = 0;
+        }
+        fclose(file);
+    }
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+/*
+ * Each device uses two fds: the device itself and its peer.
+ * Raise the soft limit to the hard limit, and return the maximum number of devices.
+ */
+static unsigned int stress_max_devices(void) {
+
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) < 0) {
+        return 0;
+    }
+    if (limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+        getrlimit(RLIMIT_NOFILE, &limit);
+    }
+    // keep a few fds for stdio, gpoll and the output file
+    return limit.rlim_cur > 64 ? (limit.rlim_cur - 64) / 2 : 0;
+}
+
+static int stress_async(unsigned int count, FILE * out) {
+
+    s_stress_device * devices = calloc(count, sizeof(*devices));
+    if (devices == NULL) {
+        fprintf(stderr, "stress: calloc failed\n");
+        return -1;
+    }
+
+    ASYNC_CALLBACKS callbacks = {
+            .fp_read = stress_read,
+            .fp_close = stress_close,
+            .fp_register = gpoll_register_fd,
+            .fp_remove = gpoll_remove_fd,
+    };
+
+    int ret = 0;
+    unsigned int opened = 0;
+
+    unsigned long resident = stress_resident();
+
+    gtime start = gtime_gettime();
+
+    for (opened = 0; opened < count; ++opened) {
+        devices[opened].device = async_open_virtual(E_ASYNC_VIRTUAL_PACKET, &devices[opened].peer);
+        if (devices[opened].device == NULL) {
+            ret = -1;
+            break;
+        }
+        if (async_set_read_size(devices[opened].device, STRESS_PACKET_SIZE) < 0
+                || async_register(devices[opened].device, NULL, &callbacks) < 0) {
+            ++opened;
+            ret = -1;
+            break;
+        }
+    }
+
+    gtime open_time = gtime_gettime() - start;
+
+    unsigned long memory = stress_resident() - resident;
+
+    gtime dispatch_time = 0;
+    unsigned int events = 0;
+
+    unsigned int round, i;
+    for (round = 0; ret == 0 && round < STRESS_ROUNDS; ++round) {
+        unsigned int subset = count < STRESS_SUBSET ? count : STRESS_SUBSET;
+        char packet[STRESS_PACKET_SIZE] = { 0 };
+        for (i = 0; i < subset; ++i) {
+            // a device may be picked several times, each packet is delivered separately
+            if (write(devices[rand() % count].peer, packet, sizeof(packet)) != sizeof(packet)) {
+                fprintf(stderr, "stress: write failed\n");
+                ret = -1;
+                break;
+            }
+        }
+        if (ret == 0) {
+            stress_pending = subset;
+            start = gtime_gettime();
+            while (stress_pending > 0) {
+                gpoll();
+            }
+            dispatch_time += gtime_gettime() - start;
+            events += subset;
+        }
+    }
+
+    start = gtime_gettime();
+
+    for (i = 0; i < opened; ++i) {
+        async_close(devices[i].device);
+    }
+
+    gtime close_time = gtime_gettime() - start;
+
+    for (i = 0; i < opened; ++i) {
+        close(devices[i].peer);
+    }
+
+    free(devices);
+
+    if (ret == 0) {
+        fprintf(out, "%u," GTIME_FS "," GTIME_FS "," GTIME_FS ",%lu\n", count, open_time / count, close_time / count,
+                events > 0 ? dispatch_time / events : 0, memory / count);
+        fflush(out);
+    }
+
+    return ret;
+}
+
+/*
+ * Run the stress test for growing device counts, up to 'max' devices, and write the results to 'path'.
+ * The count is capped by the fd limit, each device using two fds.
+ */
+static int stress_async_all(const char * path, unsigned int max) {
+
+    FILE * out = fopen(path, "w");
+    if (out == NULL) {
+        fprintf(stderr, "stress: can't open %s\n", path);
+        return -1;
+    }
+
+    fprintf(out, "devices,open_ns,close_ns,dispatch_ns,bytes_per_device\n");
+
+    unsigned int limit = stress_max_devices();
+    if (max > limit) {
+        fprintf(stderr, "stress: fd limit allows %u devices\n", limit);
+        max = limit;
+    }
+
+    int ret = 0;
+
+    unsigned int i;
+    for (i = 0; i < sizeof(stress_counts) / sizeof(*stress_counts) && stress_counts[i] <= max; ++i) {
+        if (stress_async(stress_counts[i], out) < 0) {
+            ret = -1;
+            break;
+        }
+    }
+
+    // when the limit falls between two counts, finish with the largest possible count
+    if (ret == 0 && i < sizeof(stress_counts) / sizeof(*stress_counts) && i > 0 && max > stress_counts[i - 1]) {
+        ret = stress_async(max, out);
+    }
+
+    fclose(out);
+
+    return ret;
+}